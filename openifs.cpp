@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,11 +21,40 @@
 #include <sys/wait.h>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include "./boinc/api/boinc_api.h"
 #include "./boinc/zip/boinc_zip.h"
 #include <signal.h>
 #include <zip.h>
+#include <zlib.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <utime.h>
+#include "./boinc/lib/md5_file.h"
+
+#ifndef __APPLE__
+   #include <linux/fs.h>
+   #include <sys/epoll.h>
+   #include <sys/inotify.h>
+   #include <sys/signalfd.h>
+   #include <sys/timerfd.h>
+   #include <sys/syscall.h>
+   #include <sys/prctl.h>
+   #include <sched.h>
+   #include <pthread.h>
+#else
+   #include <libproc.h>
+#endif
 
 #ifndef __has_include
    static_assert(false, "__has_include not supported");
@@ -36,42 +66,524 @@
 #    include <experimental/filesystem>
      namespace fs = std::experimental::filesystem;
 #  endif
+#  if __has_include(<zstd.h>)
+#    include <zstd.h>
+#    define HAVE_ZSTD
+#  endif
 #endif
 
 #ifndef _MAX_PATH
    #define _MAX_PATH 512
 #endif
 
+// Decides whether a file within a zip is staged, given its path within the zip
+typedef std::function<bool(const std::string&)> ENTRY_FILTER;
+
+// Ends a suspended model to release its memory, once it has a restart dump to be relaunched from on resume
+struct SUSPEND_POLICY {
+    std::string slot_path;
+    int grace;          // the seconds suspended before the model is ended, 0 never
+    bool released;      // the model has been ended during the suspend
+
+    SUSPEND_POLICY() : grace(0), released(false) {}
+};
+
+// The malloc tunables, huge pages and preloaded allocator the model is launched with, chosen per batch by name
+struct LAUNCH_PROFILE {
+    std::string name;
+    std::string glibc_tunables;   // GLIBC_TUNABLES, empty leaves the glibc malloc defaults
+    bool thp;                     // clear any inherited disabling of transparent huge pages
+    std::string preload;          // the name of an allocator library in the app's lib folder to preload, empty for none
+
+    LAUNCH_PROFILE() : name("default"), thp(false) {}
+};
+
 const char* stripPath(const char* path);
 int checkChildStatus(long,int);
-int checkBOINCStatus(long,int);
-long launchProcess(const char*,const char*,const char*);
+int checkBOINCStatus(long,int,SUSPEND_POLICY&);
+bool memoryPressure();
+double memInfo(const char*);
+int findLaunchProfile(const std::string&,int,LAUNCH_PROFILE&);
+long launchProcess(const char*,const char*,const char*,const char*,const LAUNCH_PROFILE&);
 std::string getTag(const std::string &str);
-int unzip_file(const char*);
+int unzip_file(const char*,const char*,int,const ENTRY_FILTER& = ENTRY_FILTER());
+int unzip_entry(struct zip*,zip_uint64_t,const char*,std::vector<char>&);
+int unzipFile(const std::string&,const std::string&,int,const ENTRY_FILTER& = ENTRY_FILTER());
+void benchmarkUnzip(const std::string&,const std::string&,int);
+int cacheZip(const std::string&,const std::string&,const std::string&,int,std::string&,int&);
+int zipChecksum(const std::string&,const std::string&,char*,double&);
+int unzipCached(const std::string&,const std::string&,const std::string&,int,const ENTRY_FILTER& = ENTRY_FILTER());
+int linkTree(const std::string&,const std::string&,const ENTRY_FILTER& = ENTRY_FILTER());
+std::set<std::string> selectIfsdataMembers(const std::string&,const std::string&,const std::string&,const std::string&);
+int linkFile(const std::string&,const std::string&);
+void pruneCache(const std::string&,int);
 
 using namespace std::chrono;
 using namespace std::this_thread;
 using namespace std;
 
+// An input zip staged into the working directory on its own thread
+struct STAGING_STEP {
+    std::string name;
+    std::string zip_path;
+    std::string dest_dir;
+    std::string cache_path;      // empty if the zip is not staged through the cache
+    ENTRY_FILTER filter;         // empty if every file in the zip is staged
+    std::string install_prefix;  // set if the zip is installed as a shared tree in the cache
+    std::string install_path;    // the shared tree the zip was installed into
+    int lock_fd;                 // lock held on the shared tree
+    int nthreads;
+    int retval;
+    double seconds;
+    std::thread worker;
+
+    STAGING_STEP(const std::string &step_name, const std::string &zip, const std::string &dest,
+                 const std::string &cache, int threads) :
+       name(step_name), zip_path(zip), dest_dir(dest), cache_path(cache), lock_fd(-1), nthreads(threads), retval(0), seconds(0) {}
+    ~STAGING_STEP() { if (worker.joinable()) worker.join(); }
+};
+
+void runStagingStep(STAGING_STEP*);
+int installApp(STAGING_STEP*);
+
+// The model configuration read from the fort.4 namelist
+struct OIFS_CONFIG {
+    std::string ifsdata_file;         // !IFSDATA_FILE= tag
+    std::string ic_ancil_file;        // !IC_ANCIL_FILE= tag
+    std::string climate_data_file;    // !CLIMATE_DATA_FILE= tag
+    std::string grid_type;            // !GRID_TYPE= tag
+    int horiz_resolution;             // !HORIZ_RESOLUTION= tag
+    int vert_resolution;              // !VERT_RESOLUTION= tag
+    int upload_interval;              // !UPLOAD_INTERVAL= tag, in steps
+    int timestep;                     // TSTEP, in seconds
+    int output_frequency;             // NFRPOS, in steps if positive and in hours if negative
+    int nstop;                        // NSTOP, the number of steps of the run (0 if not given)
+    int zip_threads;                  // !ZIP_THREADS= tag, the compression threads for the upload zips (0 follows the idle cores)
+    std::string upload_codec;         // !UPLOAD_CODEC= tag, the compression of the upload zips
+    std::string upload_keep;          // !UPLOAD_KEEP= tag, the GRIB fields kept in the upload zips (empty keeps all)
+    bool upload_delta;                // !UPLOAD_DELTA= tag, repack the ICMGG files as deltas against the previous step
+    std::string diag_params;          // !DIAG_PARAMS= tag, the GRIB fields summarised in the upload zips
+    int suspend_grace;                // !SUSPEND_GRACE= tag, the seconds suspended before the model is ended to release its memory
+    bool autotune;                    // !AUTOTUNE= tag, tune the OpenMP settings from the step rates of earlier tasks
+    std::string launch_profile;       // !LAUNCH_PROFILE= tag, the malloc and huge page settings the model is launched with
+    int sample_interval;              // !SAMPLE_INTERVAL= tag, the seconds between the resource samples of the model, 0 off
+    std::map<std::string,std::string> tags;                                // '!KEY=value' comment tags
+    std::map<std::string,std::map<std::string,std::string>> groups;        // namelist group -> variable -> value
+
+    OIFS_CONFIG() : horiz_resolution(0), vert_resolution(0), upload_interval(0), timestep(0),
+                    output_frequency(0), nstop(0), zip_threads(0), upload_delta(false),
+                    suspend_grace(300), autotune(false), sample_interval(10) {}
+    std::string value(const std::string &name) const;
+};
+
+// The steps at which the model writes its ICMGG/ICMSH output files and the step that ends each intermediate upload
+struct OUTPUT_SCHEDULE {
+    int nstop;
+    std::vector<int> output_steps;
+    std::vector<int> upload_steps;
+};
+
+int parseNamelist(const std::string&,OIFS_CONFIG&);
+void parseNamelistGroup(const std::string&,const std::string&,OIFS_CONFIG&);
+void buildSchedule(const OIFS_CONFIG&,int,OUTPUT_SCHEDULE&);
+std::string icmFileName(const std::string&,const char*,const std::string&,int);
+
+// Reads the lines appended to ifs.stat since it was last read, each step line is parsed once
+struct IFS_STAT_TAIL {
+    std::string path;
+    int fd;
+    off_t offset;
+    std::string partial;   // an incomplete last line
+    int last_step;         // the last step written, -1 until one has been read
+
+    IFS_STAT_TAIL(const std::string &stat_path) : path(stat_path), fd(-1), offset(0), last_step(-1) {}
+    ~IFS_STAT_TAIL() { if (fd >= 0) close(fd); }
+};
+
+// Tracks the progress of the run from the steps in ifs.stat, with the wall and CPU time per step smoothed
+// over the recent steps to estimate the time remaining
+struct PROGRESS {
+    int nstop;                        // the steps of the run
+    int last_step;                    // the last step reached, -1 until the model has written one
+    bool rebase;                      // the next step only sets the timing baseline, after a launch, suspend or pause
+    double step_seconds;              // the smoothed wall time per step, 0 until measured
+    double step_cpu_seconds;          // the smoothed CPU time of the model per step
+    double cpu_seconds;               // the CPU time of the model at the last step
+    double checkpoint_cpu_seconds;    // the CPU time of the model at its last restart dump
+    int next_log_percent;             // the progress at which the estimate is next logged
+    int nthreads;                     // the threads the model runs on
+    int measured_steps;               // the steps timed since the model was launched, excluding suspends and pauses
+    double measured_seconds;          // and their wall time
+    steady_clock::time_point last_step_time;
+
+    PROGRESS() : nstop(0), last_step(-1), rebase(true), step_seconds(0), step_cpu_seconds(0), cpu_seconds(0),
+                 checkpoint_cpu_seconds(0), next_log_percent(5), nthreads(1),
+                 measured_steps(0), measured_seconds(0) {}
+};
+
+void updateProgress(PROGRESS&,int,long);
+void reportProgress(PROGRESS&,long);
+double childCpuSeconds(long);
+
+// The OpenMP settings of the model, tuned per host and resolution from the step rates of earlier tasks
+struct OMP_TUNING {
+    int nthreads;
+    std::string schedule;       // OMP_SCHEDULE
+    std::string stacksize;      // OMP_STACKSIZE
+    double steps_per_second;    // the measured step rate, 0 if not yet measured
+    long taken;                 // the time a task took the settings to time them, 0 if not taken
+
+    OMP_TUNING() : nthreads(1), schedule("STATIC"), stacksize("128M"), steps_per_second(0), taken(0) {}
+};
+
+bool chooseTuning(const std::string&,const std::string&,int,OMP_TUNING&);
+bool fastestTuning(const std::string&,const std::string&,int,OMP_TUNING&);
+int recordTuning(const std::string&,const std::string&,const OMP_TUNING&);
+std::vector<OMP_TUNING> tuningCandidates(int);
+void readTuning(const std::string&,const std::string&,std::vector<OMP_TUNING>&);
+int writeTuning(const std::string&,const std::string&,const OMP_TUNING&);
+
+// The memory and disk a run needs, used by the controller to check the run fits before launching the model.
+// openifs_wu_submit.py only raises the rsc_memory_bound and rsc_disk_bound of the workunits above their flat
+// defaults from the same table, until it has been calibrated.
+struct FOOTPRINT {
+    double memory;    // the peak resident memory of the model, in bytes
+    double disk;      // the disk used by the slot and the upload zips, in bytes
+};
+
+void modelFootprint(const std::string&,int,int,int,FOOTPRINT&);
+double memoryLimit(const APP_INIT_DATA&);
+
+// The events that wake the monitor loop
+#define EVENT_TIMER   1   // the one second timer for checking the BOINC status
+#define EVENT_STAT    2   // ifs.stat has changed
+#define EVENT_OUTPUT  4   // the model has closed an output file
+#define EVENT_CHILD   8   // the model process has changed state
+
+struct MONITOR_EVENTS {
+    std::string stat_path;
+    int epoll_fd;
+    int inotify_fd;
+    int stat_wd;      // the inotify watch on ifs.stat, once the model has created it
+    int signal_fd;
+    int timer_fd;
+    bool watching_outputs;                  // the model closing its output files is seen, no events have been lost
+    std::set<std::string> closed_outputs;   // the output files the model has closed and not yet handled
+
+    MONITOR_EVENTS() : epoll_fd(-1), inotify_fd(-1), stat_wd(-1), signal_fd(-1), timer_fd(-1), watching_outputs(false) {}
+};
+
+// The compression of the files in an upload zip, given as 'store', 'deflate[:level]' or 'zstd[:level][:long]'
+struct UPLOAD_CODEC {
+    int method;             // the zip compression method, 0 stored, 8 deflate or 93 zstd
+    int level;
+    bool long_distance;     // zstd long distance matching over a larger window
+    std::string name;
+
+    UPLOAD_CODEC() : method(8), level(9), long_distance(false), name("deflate:9") {}
+};
+
+// The sizes and times of writing a zip
+struct ZIP_STATS {
+    uint64_t bytes_in, bytes_out;
+    double seconds, cpu_seconds;    // the wall time and the CPU time of the compression threads
+
+    ZIP_STATS() : bytes_in(0), bytes_out(0), seconds(0), cpu_seconds(0) {}
+};
+
+// An entry of a zip being written
+struct ZIP_ENTRY {
+    std::string name;
+    uint64_t size, compressed, header_offset;
+    uLong crc;
+    bool zip64;             // the local header has room for zip64 sizes
+    int method;
+    uint16_t dos_time, dos_date;
+    mode_t mode;
+};
+
+// A zip written incrementally, entries are appended as their files become available and the central directory is
+// written when the zip is finished. The entries are saved after each append so that the zip can be resumed.
+struct ZIP_ARCHIVE {
+    std::string path;
+    int fd;
+    uint64_t offset;                    // the end of the appended entries
+    std::vector<ZIP_ENTRY> entries;
+    std::string first_entry;            // the entry listed first in the central directory
+    ZIP_STATS stats;                    // summed over the appends
+
+    ZIP_ARCHIVE() : fd(-1), offset(0) {}
+};
+
+// A GRIB message within a file, the parameter is the paramId for GRIB1 and 'discipline.category.number' for GRIB2
+struct GRIB_MESSAGE {
+    uint64_t offset, length;
+    int edition;
+    std::string param;
+    int level_type;
+    long level;
+    long step;          // in the time unit of the message
+};
+
+// A GRIB field to keep in the upload files, given as 'param[/level_type[/level]]', -1 matches any level type or level
+struct GRIB_SELECT {
+    std::string param;
+    int level_type;
+    long level;
+};
+
+int scanGribFile(const std::string&,std::vector<GRIB_MESSAGE>&);
+uint64_t readBE(const unsigned char*,int);
+int readAt(int,unsigned char*,size_t,uint64_t);
+int filterGribFile(const std::string&,const std::vector<GRIB_SELECT>&,const std::string&);
+int parseKeepList(const std::string&,std::vector<GRIB_SELECT>&);
+bool keepGribMessage(const GRIB_MESSAGE&,const std::vector<GRIB_SELECT>&);
+
+// The packed values of a GRIB1 message with simple grid point packing
+struct GRIB_PACKING {
+    size_t data_offset, data_length;    // the packed values within the message
+    uint32_t nvalues;
+    int nbits;
+};
+
+bool simplePacking(const std::vector<unsigned char>&,GRIB_PACKING&);
+void unpackValues(const unsigned char*,uint32_t,int,uint32_t*);
+void packValues(const uint32_t*,uint32_t,int,unsigned char*);
+int deltaEncodeGribFile(const std::string&,const std::string&,const std::string&);
+
+// Summarises the selected fields of each completed ICMGG file on a background thread at the lowest CPU priority
+struct DIAG_WORKER {
+    std::vector<GRIB_SELECT> params;        // the fields to summarise
+    int nlat;                               // the number of Gaussian latitudes from the resolution and grid type
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::string> pending;        // the ICMGG files waiting to be summarised
+    std::set<std::string> queued;           // the ICMGG files queued and not yet summarised
+    std::map<std::string,std::string> records;   // the summary records of the summarised files
+    bool stopping;
+    double cpu_seconds;                     // the CPU time spent on the summaries
+    std::thread worker;
+
+    DIAG_WORKER() : nlat(0), stopping(false), cpu_seconds(0) {}
+    ~DIAG_WORKER() {
+       {
+          std::lock_guard<std::mutex> guard(lock);
+          stopping = true;
+          changed.notify_all();
+       }
+       if (worker.joinable()) worker.join();
+    }
+};
+
+int gaussianLatitudes(const std::string&,int);
+void gaussianWeights(int,std::vector<double>&,std::vector<double>&);
+double ibmFloat(const unsigned char*);
+int diagnoseGribFile(const std::string&,const std::vector<GRIB_SELECT>&,int,std::string&);
+void startDiagnostics(DIAG_WORKER&);
+void runDiagnostics(DIAG_WORKER*);
+void queueDiagnostics(DIAG_WORKER&,const std::string&);
+std::string takeDiagnostics(DIAG_WORKER&,const std::string&);
+double threadCpuSeconds();
+
+// A set of output files to be appended to an upload zip, and whether the zip is then finished
+struct UPLOAD_JOB {
+    int upload_file_number;
+    std::string upload_file;        // the physical path of the zip
+    std::string upload_file_name;   // the logical name to upload the zip by, empty when running standalone or no zip
+    ZipFileList files;
+    bool finish;                    // finish the zip once the files are appended
+    bool remove_files;              // remove the files once they are in the zip
+    int zip_threads;                // the threads compressing the zip
+    UPLOAD_CODEC codec;
+    std::vector<GRIB_SELECT> keep;  // the GRIB fields kept in the ICM files, empty keeps all
+    bool delta;                     // repack the ICMGG files after the first as deltas against the previous step
+    DIAG_WORKER *diagnostics;       // summarises the ICMGG files into the first file of the zip, NULL if not used
+    std::string summary_file;       // the physical path the summary is also kept at to be uploaded ahead of the zip
+    std::string summary_file_name;  // the logical name to upload the summary by, empty when running standalone
+
+    UPLOAD_JOB() : upload_file_number(0), finish(true), remove_files(true), zip_threads(1), delta(false), diagnostics(NULL) {}
+};
+
+// Packages the upload zips on a background thread at idle I/O priority, fed by a bounded queue
+struct UPLOAD_PACKAGER {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<UPLOAD_JOB> pending;     // waiting to be packaged
+    std::deque<UPLOAD_JOB> finished;    // packaged and ready to upload
+    size_t max_pending;
+    bool stopping;
+    int retval;                         // non-zero once packaging has failed
+    bool held;                          // hold the pending jobs back while the host is under pressure
+    bool idle_priority;                 // the packaging thread is at idle CPU priority
+    std::thread worker;
+
+    // Used only by the packaging thread, or once it has stopped
+    ZIP_ARCHIVE archive;                // the upload zip being built
+    int archive_number;                 // the upload file number of the zip being built, 0 if none
+    std::string summary;                // the diagnostics of the ICMGG files in the zip being built
+    std::string delta_reference;        // the ICMGG file of the previous step, kept for the next delta
+    bool remove_delta_reference;        // remove the reference once it is no longer needed
+
+    UPLOAD_PACKAGER() : max_pending(8), stopping(false), retval(0), held(false), idle_priority(false),
+                        archive_number(0), remove_delta_reference(false) {}
+};
+
+int packageUpload(UPLOAD_PACKAGER&,UPLOAD_JOB&);
+void dropDeltaReference(UPLOAD_PACKAGER&);
+int parseCodec(const std::string&,UPLOAD_CODEC&);
+int zipFiles(const std::string&,const ZipFileList&,int,const UPLOAD_CODEC&,ZIP_STATS&);
+int openArchive(ZIP_ARCHIVE&,const std::string&,bool);
+int appendArchive(ZIP_ARCHIVE&,const ZipFileList&,int,const UPLOAD_CODEC&);
+int finishArchive(ZIP_ARCHIVE&);
+void closeArchive(ZIP_ARCHIVE&);
+bool archiveHasEntry(const ZIP_ARCHIVE&,const std::string&);
+int saveArchiveState(const ZIP_ARCHIVE&);
+int loadArchiveState(ZIP_ARCHIVE&);
+void benchmarkCodecs(const std::string&,const std::string&,int);
+void appendLE(std::vector<unsigned char>&,uint64_t,int);
+int idleCores(const APP_INIT_DATA&);
+int usableCores(const APP_INIT_DATA&);
+int modelThreads(const APP_INIT_DATA&,int);
+void startPackager(UPLOAD_PACKAGER&);
+void runPackager(UPLOAD_PACKAGER*);
+bool queueUpload(UPLOAD_PACKAGER&,const UPLOAD_JOB&);
+bool takeFinishedUpload(UPLOAD_PACKAGER&,UPLOAD_JOB&);
+void stopPackager(UPLOAD_PACKAGER&);
+bool packagerBusy(UPLOAD_PACKAGER&);
+void holdPackager(UPLOAD_PACKAGER&,bool);
+int setPackagerIdle(UPLOAD_PACKAGER&,bool);
+int setIdleIOPriority();
+
+// Keeps the disk used by the task within its BOINC disk bound, pausing the model while the upload zips drain
+struct DISK_BUDGET {
+    double bound;                   // rsc_disk_bound in bytes, 0 turns the budget off
+    double pause_fraction;          // pause the model above this fraction of the bound
+    double resume_fraction;         // and resume it below this fraction
+    std::string slot_path;
+    std::string upload_prefix;      // the path and name prefix of the task's files in the project folder
+    std::vector<std::pair<std::string,std::string>> uploading;   // the physical path and logical name of the uploads in flight
+    bool paused;
+    bool warned;                    // the budget has been exceeded with nothing left to drain
+    double used;                    // the bytes in use at the last check
+    steady_clock::time_point last_check, pause_start;
+
+    DISK_BUDGET() : bound(0), pause_fraction(0.9), resume_fraction(0.8), paused(false), warned(false), used(0) {}
+};
+
+void checkDiskBudget(DISK_BUDGET&,long,bool);
+uint64_t directorySize(const std::string&);
+void uploadSummary(const UPLOAD_JOB&,DISK_BUDGET&);
+
+// Throttles the packaging and then the model while the host is under CPU, memory or I/O pressure, read from the
+// Linux pressure stall information. Each level adds to the one before.
+struct PRESSURE_POLICY {
+    bool available;                 // the kernel provides /proc/pressure
+    int level;                      // 0 none, 1 packaging deferred, 2 packaging at idle CPU priority, 3 model paused
+    double cpu, memory, io;         // the percentage of the last 10 seconds stalled at the last check
+    double peak_cpu, peak_memory, peak_io;
+    double level_seconds[4];        // the time spent at each level
+    steady_clock::time_point last_check, level_start, calm_start, pause_blocked_until;
+    bool calm;                      // the pressure has been below the current level since calm_start
+
+    PRESSURE_POLICY() : available(false), level(0), cpu(0), memory(0), io(0), peak_cpu(0), peak_memory(0), peak_io(0),
+                        level_seconds{0,0,0,0}, calm(false) {}
+};
+
+void checkPressure(PRESSURE_POLICY&,long,UPLOAD_PACKAGER&,bool);
+double readPressure(const char*,const char*);
+
+// A sample of the resources used by the model, the counters are cumulative over the life of the model process
+struct RESOURCE_SAMPLE {
+    uint32_t seconds;               // since the sampler was opened
+    uint32_t step;
+    uint32_t threads;
+    uint64_t rss;                   // in bytes
+    uint64_t peak_rss;              // in bytes
+    uint64_t major_faults;
+    uint64_t read_bytes;            // read from storage
+    uint64_t write_bytes;           // written to storage
+    uint64_t voluntary_switches;    // summed over the threads
+    uint64_t involuntary_switches;
+    uint64_t run_ns;                // the time the threads have run on a CPU
+    uint64_t delay_ns;              // the time the threads have waited on a run queue
+
+    RESOURCE_SAMPLE() : seconds(0), step(0), threads(0), rss(0), peak_rss(0), major_faults(0), read_bytes(0), write_bytes(0),
+                        voluntary_switches(0), involuntary_switches(0), run_ns(0), delay_ns(0) {}
+};
+
+// Samples the resources used by the model and its threads into a ring file in the slot, which is zipped with a
+// summary of the run into the final upload file. The ring file has a 32 byte header, the magic 'ORNG' followed by
+// little endian 32 bit fields of the version, the record size, the capacity and the interval in seconds, then the
+// 64 bit count of samples taken and 4 bytes of padding. The records follow in the order of RESOURCE_SAMPLE, the sample
+// n at record n modulo the capacity. openifs_samples_decode.py lists the samples.
+struct RESOURCE_SAMPLER {
+    std::string ring_path;
+    int interval;                   // the seconds between samples, 0 turns the sampler off
+    uint32_t capacity;              // the samples kept in the ring file
+    int fd;
+    uint64_t nsamples;
+    steady_clock::time_point start, last_sample;
+    RESOURCE_SAMPLE last;           // the previous sample, to sum the counters across a relaunch of the model
+    RESOURCE_SAMPLE totals;         // the counters summed over the run
+    uint64_t max_rss;
+    double rss_sum;
+    uint32_t max_threads;
+    double cpu_seconds;             // the CPU time spent sampling
+
+    RESOURCE_SAMPLER() : interval(0), capacity(4096), fd(-1), nsamples(0), max_rss(0), rss_sum(0), max_threads(0),
+                         cpu_seconds(0) {}
+};
+
+int openSampler(RESOURCE_SAMPLER&,const std::string&,int);
+int readSample(long,RESOURCE_SAMPLE&);
+void takeSample(RESOURCE_SAMPLER&,long,int);
+int closeSampler(RESOURCE_SAMPLER&,const std::string&);
+
+// The journal of a run kept in the slot so that a run stopped by a quit request or a client restart can be resumed
+struct RUN_STATE {
+    std::string path;
+    bool staged;                    // the inputs have been staged into the slot
+    int last_upload;                // the last upload zip finished and handed to the client, 0 if none
+    int restart_step;               // the step of the last restart dump written by the model, -1 if none
+
+    RUN_STATE(const std::string &state_path) : path(state_path), staged(false), last_upload(0), restart_step(-1) {}
+};
+
+int saveRunState(const RUN_STATE&);
+int loadRunState(RUN_STATE&);
+int readRestartStep(const std::string&);
+
+int readIfsStat(IFS_STAT_TAIL&);
+void skipIfsStat(IFS_STAT_TAIL&);
+void openMonitorEvents(MONITOR_EVENTS&,const char*);
+int waitMonitorEvents(MONITOR_EVENTS&);
+void closeMonitorEvents(MONITOR_EVENTS&);
+
 int main(int argc, char** argv) {
-    std::string IFSDATA_FILE,IC_ANCIL_FILE,CLIMATE_DATA_FILE,GRID_TYPE,TSTEP,NFRPOS,project_path,result_name,version;
-    int HORIZ_RESOLUTION,VERT_RESOLUTION,upload_interval,timestep_interval,ICM_file_interval,process_status,retval=0,i,j;
-    char* strFind[9] = {NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL};
-    char strCpy[9][_MAX_PATH],strTmp[_MAX_PATH];
+    std::string project_path,result_name,version;
+    int process_status,retval=0,i;
+    char strTmp[_MAX_PATH];
     char *pathvar;
     long handleProcess;
-    double tv_sec,tv_usec,cpu_time,fraction_done;
-    float time_per_fclen;
     struct dirent *dir;
-    struct rusage usage;
     regex_t regex;
     DIR *dirp;
 
     // Set defaults for input arguments
     std::string OIFS_EXPID;           // model experiment id, must match string in filenames
-    int NTHREADS=1;                   // default number ofexi OPENMP threads
+    int NTHREADS=1;                   // default number of OPENMP threads, set from the CPUs BOINC assigns the task
     std::string NAMELIST="fort.4";    // NAMELIST file, this name is fixed
 
+    // 'delta_encode <reference> <GRIB file> <delta file>' repacks a GRIB file as deltas and exits, this is used by
+    // openifs_delta_test.py to check the delta files decode with openifs_delta_decode.py
+    if (argc == 5 && std::string(argv[1]) == std::string("delta_encode")) return deltaEncodeGribFile(argv[2],argv[3],argv[4]);
+
+    // Block SIGCHLD before BOINC starts its threads so that it is only received through the monitor loop's signalfd
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask,SIGCHLD);
+    pthread_sigmask(SIG_BLOCK,&child_mask,NULL);
+
     // Initialise BOINC
     boinc_init();
     boinc_parse_init_data_file();
@@ -159,6 +671,11 @@ int main(int argc, char** argv) {
 
     boinc_begin_critical_section();
 
+    // A run stopped by a quit request or a client restart is resumed from the journal in the slot without staging again
+    RUN_STATE run_state(slot_path + std::string("/openifs_state"));
+    bool resuming = !loadRunState(run_state) && run_state.staged;
+    if (resuming) fprintf(stderr,"Resuming the run, the inputs are already staged and the last upload was %i\n",run_state.last_upload);
+
     // macOS
     #ifdef __APPLE__
        std::string app_name = std::string("openifs_app_") + version + std::string("_x86_64-apple-darwin.zip");
@@ -167,314 +684,164 @@ int main(int argc, char** argv) {
        std::string app_name = std::string("openifs_app_") + version + std::string("_x86_64-pc-linux-gnu.zip");
     #endif
 
-    // Copy the app file to the working directory
-    std::string app_target = project_path + app_name;
-    std::string app_destination = slot_path + std::string("/") + app_name;
-    fprintf(stderr,"Copying: %s to: %s\n",app_target.c_str(),app_destination.c_str());
-    retval = boinc_copy(app_target.c_str(),app_destination.c_str());
-    if (retval) {
-       fprintf(stderr,"..Copying the app file to the working directory failed\n");
-       return retval;
-    }
-
-    // Unzip the app zip file
-    std::string app_zip = slot_path + std::string("/") + app_name;
-    fprintf(stderr,"Unzipping the app zip file: %s\n",app_zip.c_str());
+    // Inputs are staged concurrently, each archive is extracted on its own thread and its entries
+    // are spread over the extraction threads
+    int extract_threads = std::max(1,std::min(4,(int) std::thread::hardware_concurrency()));
+    auto staging_start = steady_clock::now();
+    fprintf(stderr,"Staging the inputs with %i extraction threads per archive\n",extract_threads);
+
+    // The IC ancils, IFSDATA and climate data zips are shared between many workunits, so these are extracted once
+    // into a cache in the project directory keyed by the checksum of each zip and then linked into the slot
+    std::string cache_path = project_path + std::string("openifs_cache");
+    if (mkdir(cache_path.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0 && errno != EEXIST) \
+                       fprintf(stderr,"..mkdir for the cache folder failed\n");
+
+    // Install the app zip file once per app version as a read-only tree in the cache, the model runs from this tree
+    STAGING_STEP app_step("app",project_path + app_name,slot_path,cache_path,extract_threads);
+    app_step.install_prefix = std::string("openifs_app_") + version + std::string("_");
+    fprintf(stderr,"Installing the app zip file: %s\n",app_step.zip_path.c_str());
     fflush(stderr);
-
-    #ifdef __APPLE__ // macOS
-       retval = unzip_file(app_zip.c_str());
-    #else // Linux
-       retval = boinc_zip(UNZIP_IT,app_zip.c_str(),slot_path);
-    #endif
-
-    if (retval) {
-       fprintf(stderr,"..Unzipping the app file failed\n");
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       fs::remove(app_zip);
-    }
+    app_step.worker = std::thread(runStagingStep,&app_step);
 
     // Process the Namelist/workunit file:
     // Get the name of the 'jf_' filename from a link within the namelist file
-    std::string wu_target = getTag(slot_path + std::string("/openifs_") + unique_member_id + std::string("_") + start_date +\
+    std::string namelist_zip = getTag(slot_path + std::string("/openifs_") + unique_member_id + std::string("_") + start_date +\
                       std::string("_") + fclen + std::string("_") + batchid + std::string("_") + wuid + std::string(".zip"));
 
-    // Copy the namelist files to the working directory
-    std::string wu_destination = slot_path + std::string("/openifs_") + unique_member_id + std::string("_") + start_date +\
-                         std::string("_") + fclen + std::string("_") + batchid + std::string("_") + wuid + std::string(".zip");
-    fprintf(stderr,"Copying the namelist files from: %s to: %s\n",wu_target.c_str(),wu_destination.c_str());
-
-    retval = boinc_copy(wu_target.c_str(),wu_destination.c_str());
-    if (retval) {
-       fprintf(stderr,"..Copying the namelist files to the working directory failed\n");
-       return retval;
-    }
-
-    // Unzip the namelist zip file
-    std::string namelist_zip = slot_path + std::string("/openifs_") + unique_member_id + std::string("_") + start_date +\
-                      std::string("_") + fclen + std::string("_") + batchid + std::string("_") + wuid + std::string(".zip");
-    fprintf(stderr,"Unzipping the namelist zip file: %s\n",namelist_zip.c_str());
-    fflush(stderr);
-    retval = boinc_zip(UNZIP_IT,namelist_zip.c_str(),slot_path);
-    if (retval) {
-       fprintf(stderr,"..Unzipping the namelist file failed\n");
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       fs::remove(namelist_zip);
+    // Unzip the namelist zip file in place from the project directory into the working directory
+    if (!resuming) {
+       fprintf(stderr,"Unzipping the namelist zip file: %s\n",namelist_zip.c_str());
+       fflush(stderr);
+       auto namelist_start = steady_clock::now();
+       retval = unzipFile(namelist_zip,slot_path,1);
+       if (retval) {
+          fprintf(stderr,"..Unzipping the namelist file failed\n");
+          return retval;
+       }
+       fprintf(stderr,"Staging the namelist took %.2f seconds\n",
+               duration<double>(steady_clock::now() - namelist_start).count());
     }
 
-    // Parse the fort.4 namelist for the filenames and variables
+    // Parse the fort.4 namelist into the model configuration
     std::string namelist_file = slot_path + std::string("/") + NAMELIST;
-    const char strSearch[9][22]={"!IFSDATA_FILE=","!IC_ANCIL_FILE=","!CLIMATE_DATA_FILE=","!HORIZ_RESOLUTION=",\
-                                 "!VERT_RESOLUTION=","!GRID_TYPE=","!UPLOAD_INTERVAL=","TSTEP=","NFRPOS="};
-    memset(strCpy,0x00,9*_MAX_PATH);
-    memset(strTmp,0x00,_MAX_PATH);
-    FILE* fParse = boinc_fopen(namelist_file.c_str(),"r");
-
-    // Read the namelist file
-    if (!fParse) {
+    OIFS_CONFIG config;
+    if (parseNamelist(namelist_file,config)) {
        fprintf(stderr,"..Opening the namelist file to read failed\n");
        return 1;
     }
-    else {
-       // Start at the top of the file
-       fseek(fParse,0x00,SEEK_SET);
-       memset(strTmp,0x00,_MAX_PATH);
-       while (!feof(fParse)) {
-           memset(strTmp,0x00,_MAX_PATH);
-           fgets(strTmp,_MAX_PATH-1,fParse);
-           if (!strFind[0]) {
-               strFind[0] = strstr(strTmp,strSearch[0]);
-               if (strFind[0]) {
-                   strcpy(strCpy[0],strFind[0]);
-               }
-            }
-            if (!strFind[1]) {
-                strFind[1] = strstr(strTmp,strSearch[1]);
-                if (strFind[1]) {
-                    strcpy(strCpy[1],strFind[1]);
-		}
-            }
-            if (!strFind[2]) {
-                strFind[2] = strstr(strTmp,strSearch[2]);
-                if (strFind[2]) {
-                    strcpy(strCpy[2],strFind[2]);
-                }
-            }
-            if (!strFind[3]) {
-                strFind[3] = strstr(strTmp,strSearch[3]);
-                if (strFind[3]) {
-                    strcpy(strCpy[3],strFind[3]);
-                }
-            }
-            if (!strFind[4]) {
-                strFind[4] = strstr(strTmp,strSearch[4]);
-                if (strFind[4]) {
-                    strcpy(strCpy[4],strFind[4]);
-                }
-            }
-            if (!strFind[5]) {
-                strFind[5] = strstr(strTmp,strSearch[5]);
-                if (strFind[5]) {
-                    strcpy(strCpy[5],strFind[5]);
-                }
-            }
-            if (!strFind[6]) {
-                strFind[6] = strstr(strTmp,strSearch[6]);
-                if (strFind[6]) {
-                    strcpy(strCpy[6],strFind[6]);
-                }
-            }
-            if (!strFind[7]) {
-                strFind[7] = strstr(strTmp,strSearch[7]);
-                if (strFind[7]) {
-                    strcpy(strCpy[7],strFind[7]);
-                }
-            }
-            if (!strFind[8]) {
-                strFind[8] = strstr(strTmp,strSearch[8]);
-                if (strFind[8]) {
-                    strcpy(strCpy[8],strFind[8]);
-                }
-            }
-            if (strFind[0]&&strFind[1]&&strFind[2]&&strFind[3]&&strFind[4]&&strFind[5]&&strFind[6]&&strFind[7]&&strFind[8]) {
-                break;
-            }
-       }
-       // Either feof or we hit the string		
-       if (strCpy[0][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[0] + strlen(strSearch[0])),100);
-            IFSDATA_FILE = strTmp;
-            // Handle any white space in tags
-            while(!IFSDATA_FILE.empty() && \
-                  std::isspace(*IFSDATA_FILE.rbegin())) IFSDATA_FILE.erase(IFSDATA_FILE.length()-1);
-            fprintf(stderr,"IFSDATA_FILE: %s\n",IFSDATA_FILE.c_str());
-       }
-       if (strCpy[1][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[1] + strlen(strSearch[1])),100);
-            IC_ANCIL_FILE = strTmp; 
-            while(!IC_ANCIL_FILE.empty() && \
-                  std::isspace(*IC_ANCIL_FILE.rbegin())) IC_ANCIL_FILE.erase(IC_ANCIL_FILE.length()-1);
-            fprintf(stderr,"IC_ANCIL_FILE: %s\n",IC_ANCIL_FILE.c_str());
-       }
-       if (strCpy[2][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[2] + strlen(strSearch[2])),100);
-            CLIMATE_DATA_FILE = strTmp; 
-            while(!CLIMATE_DATA_FILE.empty() && \
-                  std::isspace(*CLIMATE_DATA_FILE.rbegin())) CLIMATE_DATA_FILE.erase(CLIMATE_DATA_FILE.length()-1);
-            fprintf(stderr,"CLIMATE_DATA_FILE: %s\n",CLIMATE_DATA_FILE.c_str());
-       }
-       if (strCpy[3][0] != 0x00) {
-            HORIZ_RESOLUTION=atoi(strCpy[3] + strlen(strSearch[3]));
-            fprintf(stderr,"HORIZ_RESOLUTION: %i\n",HORIZ_RESOLUTION);
-       }
-       if (strCpy[4][0] != 0x00) {
-            VERT_RESOLUTION=atoi(strCpy[4] + strlen(strSearch[4]));
-            fprintf(stderr,"VERT_RESOLUTION: %i\n",VERT_RESOLUTION);
-       }
-       if (strCpy[5][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[5] + strlen(strSearch[5])),100);
-            GRID_TYPE = strTmp; 
-            while(!GRID_TYPE.empty() && std::isspace(*GRID_TYPE.rbegin())) GRID_TYPE.erase(GRID_TYPE.length()-1);
-            fprintf(stderr,"GRID_TYPE: %s\n",GRID_TYPE.c_str());
-       }
-       if (strCpy[6][0] != 0x00) {
-            upload_interval=atoi(strCpy[6] + strlen(strSearch[6]));
-            fprintf(stderr,"UPLOAD_INTERVAL: %i\n",upload_interval);
-       }
-       if (strCpy[7][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[7] + strlen(strSearch[7])),100);
-            TSTEP = strTmp; 
-            while(!TSTEP.empty() && \
-                  std::isspace(*TSTEP.rbegin())) TSTEP.erase(TSTEP.length()-1);
-            // Remove the trailing comma
-            if (!TSTEP.empty()) TSTEP.resize(TSTEP.size() - 1);
-            fprintf(stderr,"TSTEP: %s\n",TSTEP.c_str());
-            // Convert to an integer
-            timestep_interval = std::stoi(TSTEP);
-       }
-       if (strCpy[8][0] != 0x00) {
-            memset(strTmp,0x00,_MAX_PATH);
-            strncpy(strTmp,(char*)(strCpy[8] + strlen(strSearch[8])),100);
-            NFRPOS = strTmp; 
-            while(!NFRPOS.empty() && \
-                  std::isspace(*NFRPOS.rbegin())) NFRPOS.erase(NFRPOS.length()-1);
-            // Remove the trailing comma
-            if (!NFRPOS.empty()) NFRPOS.resize(NFRPOS.size() - 1);
-            fprintf(stderr,"NFRPOS: %s\n",NFRPOS.c_str());
-            // Convert to an integer
-            ICM_file_interval = std::stoi(NFRPOS);
-       }
-       fclose(fParse);
+    fprintf(stderr,"IFSDATA_FILE: %s\n",config.ifsdata_file.c_str());
+    fprintf(stderr,"IC_ANCIL_FILE: %s\n",config.ic_ancil_file.c_str());
+    fprintf(stderr,"CLIMATE_DATA_FILE: %s\n",config.climate_data_file.c_str());
+    fprintf(stderr,"HORIZ_RESOLUTION: %i\n",config.horiz_resolution);
+    fprintf(stderr,"VERT_RESOLUTION: %i\n",config.vert_resolution);
+    fprintf(stderr,"GRID_TYPE: %s\n",config.grid_type.c_str());
+    fprintf(stderr,"UPLOAD_INTERVAL: %i\n",config.upload_interval);
+    fprintf(stderr,"TSTEP: %i\n",config.timestep);
+    fprintf(stderr,"NFRPOS: %i\n",config.output_frequency);
+    fprintf(stderr,"NSTOP: %i\n",config.nstop);
+    if (config.zip_threads > 0) fprintf(stderr,"ZIP_THREADS: %i\n",config.zip_threads);
+    if (!config.upload_codec.empty()) fprintf(stderr,"UPLOAD_CODEC: %s\n",config.upload_codec.c_str());
+    if (!config.upload_keep.empty()) fprintf(stderr,"UPLOAD_KEEP: %s\n",config.upload_keep.c_str());
+    if (config.upload_delta) fprintf(stderr,"UPLOAD_DELTA: 1\n");
+    if (!config.diag_params.empty()) fprintf(stderr,"DIAG_PARAMS: %s\n",config.diag_params.c_str());
+    fprintf(stderr,"SUSPEND_GRACE: %i\n",config.suspend_grace);
+    if (config.autotune) fprintf(stderr,"AUTOTUNE: 1\n");
+    if (!config.launch_profile.empty()) fprintf(stderr,"LAUNCH_PROFILE: %s\n",config.launch_profile.c_str());
+    fprintf(stderr,"SAMPLE_INTERVAL: %i\n",config.sample_interval);
+    if (!config.value("NFRRES").empty()) fprintf(stderr,"NFRRES: %s\n",config.value("NFRRES").c_str());
+    else fprintf(stderr,"..NFRRES is not set, a run that is stopped will restart from the first step\n");
+
+    // In standalone mode an optional 'benchmark' argument times unzipping the IFSDATA and climate data zips
+    // with boinc_zip against the extraction engine and then exits
+    if (boinc_is_standalone() && argc > 8 && std::string(argv[8]) == std::string("benchmark")) {
+       std::string benchmark_path = slot_path + std::string("/unzip_benchmark");
+       benchmarkUnzip(getTag(slot_path + std::string("/") + config.ifsdata_file + std::string(".zip")),benchmark_path,extract_threads);
+       benchmarkUnzip(getTag(slot_path + std::string("/") + config.climate_data_file + std::string(".zip")),benchmark_path,extract_threads);
+       return 0;
     }
 
+    // In standalone mode an optional 'benchmark_codecs' argument zips the ICM output files left in the working
+    // directory by an earlier run with each of the upload codecs and then exits
+    if (boinc_is_standalone() && argc > 8 && std::string(argv[8]) == std::string("benchmark_codecs")) {
+       benchmarkCodecs(slot_path,slot_path + std::string("/codec_benchmark"),idleCores(dataBOINC));
+       return 0;
+    }
 
     // Process the IC_ANCIL_FILE:
     // Get the name of the 'jf_' filename from a link within the IC_ANCIL_FILE
-    std::string ic_ancil_target = getTag(slot_path + std::string("/") + IC_ANCIL_FILE + std::string(".zip"));
-
-    // Copy the IC ancils to working directory
-    std::string ic_ancil_destination = slot_path + std::string("/") + IC_ANCIL_FILE + std::string(".zip");
-    fprintf(stderr,"Copying IC ancils from: %s to: %s\n",ic_ancil_target.c_str(),ic_ancil_destination.c_str());
-    retval = boinc_copy(ic_ancil_target.c_str(),ic_ancil_destination.c_str());
-    if (retval) {
-       fprintf(stderr,"..Copying the IC ancils to the working directory failed\n");
-       return retval;
-    }
+    std::string ic_ancil_target = getTag(slot_path + std::string("/") + config.ic_ancil_file + std::string(".zip"));
 
-    // Unzip the IC ancils zip file
-    std::string ic_ancil_zip = slot_path + std::string("/") + IC_ANCIL_FILE + std::string(".zip");
-    fprintf(stderr,"Unzipping the IC ancils zip file: %s\n",ic_ancil_zip.c_str());
-    fflush(stderr);
-    retval = boinc_zip(UNZIP_IT,ic_ancil_zip.c_str(),slot_path);
-    if (retval) {
-       fprintf(stderr,"..Unzipping the IC ancils file failed\n");
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       fs::remove(ic_ancil_zip);
-    }
+    // Stage the IC ancils into the working directory
+    STAGING_STEP ic_ancil_step("IC ancils",ic_ancil_target,slot_path,cache_path,extract_threads);
+    fprintf(stderr,"Staging the IC ancils from: %s to: %s\n",ic_ancil_target.c_str(),slot_path);
 
 
     // Process the IFSDATA_FILE:
     // Make the ifsdata directory
     std::string ifsdata_folder = slot_path + std::string("/ifsdata");
-    if (mkdir(ifsdata_folder.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) fprintf(stderr,"..mkdir for ifsdata folder failed\n");
+    if (!resuming && mkdir(ifsdata_folder.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) \
+                       fprintf(stderr,"..mkdir for ifsdata folder failed\n");
 
     // Get the name of the 'jf_' filename from a link within the IFSDATA_FILE
-    std::string ifsdata_target = getTag(slot_path + std::string("/") + IFSDATA_FILE + std::string(".zip"));
-
-    // Copy the IFSDATA_FILE to working directory
-    std::string ifsdata_destination = slot_path + std::string("/ifsdata/") + IFSDATA_FILE + std::string(".zip");
-    fprintf(stderr,"Copying IFSDATA_FILE from: %s to: %s\n",ifsdata_target.c_str(),ifsdata_destination.c_str());
-    retval = boinc_copy(ifsdata_target.c_str(),ifsdata_destination.c_str());
-    if (retval) {
-       fprintf(stderr,"..Copying the IFSDATA file to the working directory failed\n");
-       return retval;
-    }
-
-    // Unzip the IFSDATA_FILE zip file
-    std::string ifsdata_zip = slot_path + std::string("/ifsdata/") + IFSDATA_FILE + std::string(".zip");
-    fprintf(stderr,"Unzipping IFSDATA_FILE zip file: %s\n", ifsdata_zip.c_str());
-    fflush(stderr);
-    retval = boinc_zip(UNZIP_IT,ifsdata_zip.c_str(),slot_path+std::string("/ifsdata/"));
-    if (retval) {
-       fprintf(stderr,"..Unzipping the IFSDATA file failed\n");
-       return retval;
-    }
-    // Remove the zip file
-    else {
-       fs::remove(ifsdata_zip);
+    std::string ifsdata_target = getTag(slot_path + std::string("/") + config.ifsdata_file + std::string(".zip"));
+
+    // Stage the IFSDATA_FILE into the ifsdata directory, only the files the run will read are staged
+    STAGING_STEP ifsdata_step("IFSDATA",ifsdata_target,ifsdata_folder,cache_path,extract_threads);
+    std::set<std::string> ifsdata_members;
+    if (!resuming) ifsdata_members = selectIfsdataMembers(ifsdata_target,start_date,fclen,
+                                                          slot_path + std::string("/ifsdata_manifest.txt"));
+    if (!ifsdata_members.empty()) {
+       ifsdata_step.filter = [&ifsdata_members](const std::string &name) { return ifsdata_members.count(name) > 0; };
     }
+    fprintf(stderr,"Staging IFSDATA_FILE from: %s to: %s\n",ifsdata_target.c_str(),ifsdata_folder.c_str());
 
 
     // Process the CLIMATE_DATA_FILE:
     // Make the climate data directory
     std::string climate_data_path = slot_path + std::string("/") + \
-                       std::to_string(HORIZ_RESOLUTION) + std::string(GRID_TYPE);
-    if (mkdir(climate_data_path.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) \
+                       std::to_string(config.horiz_resolution) + config.grid_type;
+    if (!resuming && mkdir(climate_data_path.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) \
                        fprintf(stderr,"..mkdir for the climate data folder failed\n");
 
     // Get the name of the 'jf_' filename from a link within the CLIMATE_DATA_FILE
-    std::string climate_data_target = getTag(slot_path + std::string("/") + CLIMATE_DATA_FILE + std::string(".zip"));
-
-    // Copy the climate data file to working directory
-    std::string climate_data_destination = slot_path + std::string("/") + \
-                                           std::to_string(HORIZ_RESOLUTION) + std::string(GRID_TYPE) + \
-                                           std::string("/") + CLIMATE_DATA_FILE + std::string(".zip");
-    fprintf(stderr,"Copying the climate data file from: %s to: %s\n",climate_data_target.c_str(),climate_data_destination.c_str());
-    retval = boinc_copy(climate_data_target.c_str(),climate_data_destination.c_str());
-    if (retval) {
-       fprintf(stderr,"..Copying the climate data file to the working directory failed\n");
-       return retval;
-    }	
+    std::string climate_data_target = getTag(slot_path + std::string("/") + config.climate_data_file + std::string(".zip"));
 
-    // Unzip the climate data zip file
-    std::string climate_zip = slot_path + std::string("/") + \
-                              std::to_string(HORIZ_RESOLUTION) + std::string(GRID_TYPE) + \
-                              std::string("/") + CLIMATE_DATA_FILE + std::string(".zip");
-    fprintf(stderr,"Unzipping the climate data zip file: %s\n",climate_zip.c_str());
+    // Stage the climate data file into the climate data directory
+    STAGING_STEP climate_data_step("climate data",climate_data_target,climate_data_path,cache_path,extract_threads);
+    fprintf(stderr,"Staging the climate data file from: %s to: %s\n",climate_data_target.c_str(),climate_data_path.c_str());
     fflush(stderr);
-    retval = boinc_zip(UNZIP_IT,climate_zip.c_str(),\
-                       slot_path+std::string("/")+std::to_string(HORIZ_RESOLUTION)+std::string(GRID_TYPE));
-    if (retval) {
-       fprintf(stderr,"..Unzipping the climate data file failed\n");
-       return retval;
+
+    // Run the remaining staging steps concurrently and wait for all of them to finish, a resumed run only
+    // reinstalls the app, which holds the lock on its tree in the cache
+    int nstaging_steps = resuming ? 1 : 4;
+    if (!resuming) {
+       ic_ancil_step.worker = std::thread(runStagingStep,&ic_ancil_step);
+       ifsdata_step.worker = std::thread(runStagingStep,&ifsdata_step);
+       climate_data_step.worker = std::thread(runStagingStep,&climate_data_step);
     }
-    // Remove the zip file
-    else {
-       fs::remove(climate_zip);
+
+    STAGING_STEP* staging_steps[4] = {&app_step,&ic_ancil_step,&ifsdata_step,&climate_data_step};
+    for (i = 0; i < nstaging_steps; i++) {
+       staging_steps[i]->worker.join();
+       fprintf(stderr,"Staging the %s took %.2f seconds\n",staging_steps[i]->name.c_str(),staging_steps[i]->seconds);
+    }
+    for (i = 0; i < nstaging_steps; i++) {
+       if (staging_steps[i]->retval) {
+          fprintf(stderr,"..Staging the %s file failed\n",staging_steps[i]->name.c_str());
+          return staging_steps[i]->retval;
+       }
+    }
+    fflush(stderr);
+
+    // Remove cache entries that have not been used by any task for 30 days
+    pruneCache(cache_path,30);
+
+    // Record that the inputs are staged, a fresh run starts from the first step
+    if (!resuming) {
+       std::error_code ec;
+       fs::remove(slot_path + std::string("/rcf"),ec);
+       run_state.staged = true;
+       if (saveRunState(run_state)) return 1;
     }
 
 	
@@ -489,6 +856,62 @@ int main(int argc, char** argv) {
     pathvar = getenv("OIFS_DUMMY_ACTION");
     fprintf(stderr,"The OIFS_DUMMY_ACTION environmental variable is: %s\n",pathvar);
 
+    // The model runs on the CPUs BOINC has assigned the task, up to the threads that are useful at its resolution
+    NTHREADS = modelThreads(dataBOINC,config.horiz_resolution);
+    fprintf(stderr,"Running the model on %i threads, BOINC assigned %.2f CPUs\n",NTHREADS,dataBOINC.ncpus);
+
+    // With autotuning each task of a resolution on the host tries the next untimed OpenMP settings, once all have been
+    // timed the fastest is used. The step rates are cached in the project folder for the tasks that follow.
+    OMP_TUNING tuning;
+    tuning.nthreads = NTHREADS;
+    std::string tuning_path = project_path + std::string("openifs_autotune.txt");
+    std::string tuning_key = std::to_string(config.horiz_resolution) + config.grid_type + std::string("_L") +
+                             std::to_string(config.vert_resolution) + std::string("_") + std::to_string(NTHREADS) + std::string("cpus");
+    bool tuning_trial = false;
+    int tuning_ncpus = NTHREADS;
+    if (config.autotune) {
+       tuning_trial = chooseTuning(tuning_path,tuning_key,tuning_ncpus,tuning);
+       NTHREADS = tuning.nthreads;
+       fprintf(stderr,"%s the OpenMP settings for %s: %i threads, OMP_SCHEDULE=%s, OMP_STACKSIZE=%s\n",
+               tuning_trial ? "Timing" : "Using the fastest",tuning_key.c_str(),tuning.nthreads,tuning.schedule.c_str(),
+               tuning.stacksize.c_str());
+    }
+
+    // Check the host can hold the model before it is launched. The threads are reduced until the model fits in the
+    // memory available and allowed by the BOINC preferences, otherwise the task is deferred rather than left to swap.
+    FOOTPRINT footprint;
+    modelFootprint(config.grid_type,config.horiz_resolution,config.vert_resolution,NTHREADS,footprint);
+    double memory_limit = memoryLimit(dataBOINC);
+    while (memory_limit > 0 && footprint.memory > memory_limit && NTHREADS > 1) {
+       NTHREADS--;
+       modelFootprint(config.grid_type,config.horiz_resolution,config.vert_resolution,NTHREADS,footprint);
+    }
+    fprintf(stderr,"The model needs about %.0f MB of memory on %i threads and %.0f MB of disk, %.0f MB of memory can be used\n",
+            footprint.memory/1e6,NTHREADS,footprint.disk/1e6,memory_limit/1e6);
+    // Settings that cannot be timed as chosen are released for another task to time
+    auto releaseTuning = [&]() {
+       if (!tuning_trial) return;
+       tuning.taken = 0;
+       recordTuning(tuning_path,tuning_key,tuning);
+       tuning_trial = false;
+    };
+    if (NTHREADS != tuning.nthreads) releaseTuning();
+
+    double disk_needed = footprint.disk - (double) directorySize(slot_path);
+    if (dataBOINC.rsc_disk_bound > 0 && footprint.disk > dataBOINC.rsc_disk_bound) {
+       fprintf(stderr,"..The disk bound of %.0f MB is below the %.0f MB the run needs\n",dataBOINC.rsc_disk_bound/1e6,footprint.disk/1e6);
+    }
+    if ((memory_limit > 0 && footprint.memory > memory_limit) ||
+        (dataBOINC.host_info.d_free > 0 && disk_needed > dataBOINC.host_info.d_free)) {
+       fprintf(stderr,"..The host does not have the memory or disk to run the model now\n");
+       fflush(stderr);
+       if (!boinc_is_standalone()) {
+          releaseTuning();
+          boinc_end_critical_section();
+          boinc_temporary_exit(600,"Waiting for the memory or disk to run the model");
+       }
+    }
+
     // Set the OMP_NUM_THREADS environmental variable, the number of threads
     std::string OMP_NUM_var = std::string("OMP_NUM_THREADS=") + std::to_string(NTHREADS);
     if (putenv((char *)OMP_NUM_var.c_str())) {
@@ -498,8 +921,21 @@ int main(int argc, char** argv) {
     pathvar = getenv("OMP_NUM_THREADS");
     fprintf(stderr,"The OMP_NUM_THREADS environmental variable is: %s\n",pathvar);
 
+    // Set the OMP_PLACES and OMP_PROC_BIND environmental variables to bind the threads to cores, only when the task
+    // has every CPU BOINC may use so that the threads of other tasks are not bound to the same cores
+    std::string OMP_PLACES_var = std::string("OMP_PLACES=cores");
+    std::string OMP_BIND_var = std::string("OMP_PROC_BIND=close");
+    if (NTHREADS > 1 && NTHREADS >= usableCores(dataBOINC)) {
+       if (putenv((char *)OMP_PLACES_var.c_str()) || putenv((char *)OMP_BIND_var.c_str())) {
+         fprintf(stderr,"..Setting the OMP_PLACES and OMP_PROC_BIND environmental variables failed\n");
+         return 1;
+       }
+       fprintf(stderr,"The OMP_PLACES environmental variable is: %s\n",getenv("OMP_PLACES"));
+       fprintf(stderr,"The OMP_PROC_BIND environmental variable is: %s\n",getenv("OMP_PROC_BIND"));
+    }
+
     // Set the OMP_SCHEDULE environmental variable, this enforces static thread scheduling
-    std::string OMP_SCHED_var = std::string("OMP_SCHEDULE=STATIC");
+    std::string OMP_SCHED_var = std::string("OMP_SCHEDULE=") + tuning.schedule;
     if (putenv((char *)OMP_SCHED_var.c_str())) {
       fprintf(stderr,"..Setting the OMP_SCHEDULE environmental variable failed\n");
       return 1;
@@ -535,7 +971,7 @@ int main(int argc, char** argv) {
     fprintf(stderr, "The DR_HOOK_STACKCHECK environmental variable is: %s\n",pathvar);
 
     // Set the OMP_STACKSIZE environmental variable, OpenIFS needs more stack memory per process
-    std::string OMP_STACK_var = std::string("OMP_STACKSIZE=128M");
+    std::string OMP_STACK_var = std::string("OMP_STACKSIZE=") + tuning.stacksize;
     if (putenv((char *)OMP_STACK_var.c_str())) {
       fprintf(stderr,"..Setting the OMP_STACKSIZE environmental variable failed\n");
       return 1;
@@ -583,35 +1019,28 @@ int main(int argc, char** argv) {
     #endif
 
 
-    cpu_time = 0;
-    fraction_done = 0;
-    time_per_fclen = 0.27;	
+    // The progress of the run is taken from the steps the model reaches
+    PROGRESS progress;
 
-    ZipFileList zfl;
-    std::string ifs_line, iter, upload_file_name, ifs_word, second_part;
-    int current_iter=0, count=0, upload_file_number = 1;
-    std::ifstream ifs_stat_file;
-    char upload_file[_MAX_PATH];
+    int current_iter=0, upload_file_number = 1, events;
+    IFS_STAT_TAIL ifs_stat(slot_path + std::string("/ifs.stat"));
+    MONITOR_EVENTS monitor;
+    UPLOAD_PACKAGER packager;
+    UPLOAD_JOB finished_job;
     char result_base_name[64]; 
     memset(result_base_name, 0x00, sizeof(char) * 64);
 
-    // seconds between upload files: upload_interval
-    // seconds between ICM files: ICM_file_interval * timestep_interval
-    // upload interval in steps = upload_interval / timestep_interval
-
-    //fprintf(stderr,"upload_interval x timestep_interval: %i\n",(upload_interval * timestep_interval));
-
-    // Check if upload_interval x timestep_interval equal to zero
-    if (upload_interval * timestep_interval == 0) {
-       fprintf(stderr,"..upload_interval x timestep_interval equals zero\n");
+    // Check if upload_interval x timestep equal to zero
+    if (config.upload_interval * config.timestep == 0) {
+       fprintf(stderr,"..upload_interval x timestep equals zero\n");
        return 1;
     }
 
-    // time of the last upload file (in seconds)
-    int last_upload = 0;
-
-    int total_length_of_simulation = std::stoi(fclen) * 86400;
-    //fprintf(stderr,"total_length_of_simulation: %i\n",total_length_of_simulation);
+    // Work out the steps at which the model writes its output files and the step at the end of each upload
+    OUTPUT_SCHEDULE schedule;
+    buildSchedule(config,std::stoi(fclen),schedule);
+    fprintf(stderr,"The run has %i steps, %lu output steps and %lu intermediate uploads\n",
+            schedule.nstop,schedule.output_steps.size(),schedule.upload_steps.size());
 
     // Get result_base_name to construct upload file names using 
     // the first upload as an example and then stripping off '_1.zip'
@@ -628,214 +1057,427 @@ int main(int argc, char** argv) {
     }
 
 
+    // Compress the upload files on the cores BOINC leaves idle, unless set in the namelist
+    int zip_threads = config.zip_threads > 0 ? config.zip_threads : idleCores(dataBOINC);
+    UPLOAD_CODEC upload_codec;
+    if (!config.upload_codec.empty() && parseCodec(config.upload_codec,upload_codec)) {
+       fprintf(stderr,"..The upload codec %s is not available, using %s\n",config.upload_codec.c_str(),UPLOAD_CODEC().name.c_str());
+       upload_codec = UPLOAD_CODEC();
+    }
+    fprintf(stderr,"Compressing the upload files with %s on %i threads\n",upload_codec.name.c_str(),zip_threads);
+
+    // The GRIB fields to keep in the ICM files before they are zipped
+    std::vector<GRIB_SELECT> upload_keep;
+    if (!config.upload_keep.empty() && parseKeepList(config.upload_keep,upload_keep)) {
+       fprintf(stderr,"..The upload keep list %s is not valid, keeping all fields\n",config.upload_keep.c_str());
+       upload_keep.clear();
+    }
+
+    // Summarise the selected fields of each ICMGG file once the model has moved past its step
+    DIAG_WORKER diag_worker;
+    std::vector<GRIB_SELECT> diag_params;
+    size_t next_diag_output = 0, next_append = 0;
+    if (!config.diag_params.empty() && parseKeepList(config.diag_params,diag_params)) {
+       fprintf(stderr,"..The diagnostics fields %s are not valid, no diagnostics are made\n",config.diag_params.c_str());
+       diag_params.clear();
+    }
+    if (!diag_params.empty()) {
+       diag_worker.params = diag_params;
+       diag_worker.nlat = gaussianLatitudes(config.grid_type,config.horiz_resolution);
+       startDiagnostics(diag_worker);
+    }
+
+    // Name the upload file, in BOINC the upload file is uploaded by its logical name, not the physical name
+    auto makeUploadJob = [&](int number) {
+       UPLOAD_JOB job;
+       job.upload_file_number = number;
+       job.zip_threads = zip_threads;
+       job.codec = upload_codec;
+       job.keep = upload_keep;
+       job.delta = config.upload_delta;
+       job.diagnostics = diag_params.empty() ? NULL : &diag_worker;
+       if (!boinc_is_standalone()) {
+          job.upload_file = project_path + result_base_name + std::string("_") + std::to_string(number) + std::string(".zip");
+          job.upload_file_name = std::string("upload_file_") + std::to_string(number) + std::string(".zip");
+          if (job.diagnostics) {
+             job.summary_file = project_path + result_base_name + std::string("_") + std::to_string(number) + std::string("_diagnostics.txt");
+             job.summary_file_name = std::string("diagnostics_file_") + std::to_string(number) + std::string(".txt");
+          }
+       }
+       else {
+          job.upload_file = project_path + std::string("openifs_") + unique_member_id + std::string("_") + start_date + \
+                            std::string("_") + fclen + std::string("_") + batchid + std::string("_") + wuid + \
+                            std::string("_") + std::to_string(number) + std::string(".zip");
+       }
+       return job;
+    };
+
+    // Keep the disk use of the slot and the upload zips within the disk bound, which is not known when running standalone
+    DISK_BUDGET disk_budget;
+    if (!boinc_is_standalone() && dataBOINC.rsc_disk_bound > 0) {
+       disk_budget.bound = dataBOINC.rsc_disk_bound;
+       disk_budget.slot_path = slot_path;
+       disk_budget.upload_prefix = project_path + result_base_name + std::string("_");
+       fprintf(stderr,"Pausing the model above %.0f MB of disk use until the uploads drain\n",
+               disk_budget.pause_fraction * disk_budget.bound/1e6);
+    }
+
+    // A resumed run continues the upload numbering, handing the client any zip that was finished but not uploaded.
+    // The model resumes from its last restart dump, so ifs.stat is followed from its current end.
+    if (resuming) {
+       upload_file_number = run_state.last_upload + 1;
+       for (UPLOAD_JOB job = makeUploadJob(upload_file_number); fs::exists(job.upload_file); job = makeUploadJob(++upload_file_number)) {
+          uploadSummary(job,disk_budget);
+          if (!job.upload_file_name.empty()) {
+             fprintf(stderr,"Uploading file: %s\n",job.upload_file_name.c_str());
+             boinc_upload_file(job.upload_file_name);
+          }
+          run_state.last_upload = upload_file_number;
+       }
+       for (int number = 1; number <= run_state.last_upload; number++) {
+          UPLOAD_JOB job = makeUploadJob(number);
+          if (!job.summary_file_name.empty() && fs::exists(job.summary_file))
+             disk_budget.uploading.emplace_back(job.summary_file,job.summary_file_name);
+          if (!job.upload_file_name.empty() && fs::exists(job.upload_file))
+             disk_budget.uploading.emplace_back(job.upload_file,job.upload_file_name);
+       }
+
+       run_state.restart_step = readRestartStep(slot_path);
+       if (run_state.restart_step >= 0) current_iter = run_state.restart_step;
+       skipIfsStat(ifs_stat);
+       saveRunState(run_state);
+       fprintf(stderr,"Resuming the model from step %i with upload file %i\n",current_iter,upload_file_number);
+    }
+
+    // End the model during a long suspend to release its memory, it is relaunched from its restart dump on resume
+    SUSPEND_POLICY suspend_policy;
+    suspend_policy.slot_path = slot_path;
+    suspend_policy.grace = config.suspend_grace;
+    steady_clock::time_point relaunch_start;
+    bool relaunched = false;
+
+    // The fastest OpenMP settings to switch to once an autotune trial has been timed, at the next restart dump
+    OMP_TUNING next_tuning;
+    bool tuning_switch = false, tuning_switch_due = false;
+
+    progress.nstop = schedule.nstop;
+    progress.nthreads = NTHREADS;
+    if (resuming) progress.last_step = current_iter;
+
+    // Throttle the packaging and the model when the host is contended, where the kernel reports its pressure
+    PRESSURE_POLICY pressure;
+    pressure.available = (readPressure("cpu","some") >= 0);
+    if (!pressure.available) fprintf(stderr,"Host pressure is not available, the model and the packaging are not throttled\n");
+
+    // Sample the resources the model uses into a ring file zipped with the final upload file
+    RESOURCE_SAMPLER sampler;
+    if (config.sample_interval > 0) openSampler(sampler,slot_path + std::string("/resources.bin"),config.sample_interval);
+
+    // Package the upload files in the background so that the monitor loop keeps servicing the model and BOINC
+    startPackager(packager);
+
+    // Watch the working directory before the model starts so that no change is missed
+    openMonitorEvents(monitor,slot_path);
+
+    // The malloc and huge page settings of the model, the default profile leaves the environment as it is
+    LAUNCH_PROFILE launch_profile;
+    if (!config.launch_profile.empty() && findLaunchProfile(config.launch_profile,NTHREADS,launch_profile)) {
+       fprintf(stderr,"..The launch profile %s is not known, using the default profile\n",config.launch_profile.c_str());
+       launch_profile = LAUNCH_PROFILE();
+    }
+    fprintf(stderr,"Launching the model with the %s profile\n",launch_profile.name.c_str());
+
     // Start the OpenIFS job
-    std::string strCmd = slot_path + std::string("/./master.exe");
-    handleProcess = launchProcess(slot_path,strCmd.c_str(),exptid.c_str());
+    std::string strCmd = app_step.install_path + std::string("/master.exe");
+    handleProcess = launchProcess(slot_path,app_step.install_path.c_str(),strCmd.c_str(),exptid.c_str(),launch_profile);
     if (handleProcess > 0) process_status = 0;
+    fprintf(stderr,"Time from the start of staging to launching the model: %.2f seconds\n",
+            duration<double>(steady_clock::now() - staging_start).count());
 
     boinc_end_critical_section();
 
 
-    int total_count = 0;
-
     // process_status = 0 running
     // process_status = 1 stopped normally
-    // process_status = 2 stopped with quit request from BOINC
+    // process_status = 2 stopped with quit request from BOINC, or the BOINC client has gone, to be resumed
     // process_status = 3 stopped with child process being killed
     // process_status = 4 stopped with child process being stopped
-
-
-    // Periodically check the process status and the BOINC client status
+    // process_status = 5 child process ended during a suspend to release its memory, to be relaunched
+
+
+    // The step this launch of the model started from, the output of earlier steps is not written again
+    int launch_step = current_iter;
+
+    // An output step is ready once the model has closed its ICMGG and ICMSH files. Without the close events, as on
+    // the polling path, the step is ready once ifs.stat shows the model has moved past it, as it is for the steps
+    // written before this launch and for a step that has only one of the files.
+    auto outputReady = [&](int output_step) {
+       std::string icmgg_file = icmFileName(slot_path,"ICMGG",exptid,output_step);
+       std::string icmsh_file = icmFileName(slot_path,"ICMSH",exptid,output_step);
+       bool icmgg_closed = monitor.closed_outputs.count(fs::path(icmgg_file).filename().string()) > 0;
+       bool icmsh_closed = monitor.closed_outputs.count(fs::path(icmsh_file).filename().string()) > 0;
+       if (icmgg_closed && icmsh_closed) return true;
+       if (output_step >= current_iter) return false;
+       if (!monitor.watching_outputs || output_step <= launch_step) return true;
+       return (icmgg_closed || !fs::exists(icmgg_file)) && (icmsh_closed || !fs::exists(icmsh_file));
+    };
+
+    // Wait on changes to ifs.stat and the output files, the child process and the BOINC status timer
     while (process_status == 0) {
-       sleep_until(system_clock::now() + seconds(1));
-
-       count++;
-       total_count++;
-
-       // Check every 60 seconds whether an upload point has been reached
-       if(count==60) {   
-          if(!(ifs_stat_file.is_open())) {
-             //fprintf(stderr,"Opening ifs.stat file\n");
-             ifs_stat_file.open(slot_path + std::string("/ifs.stat"));
-          }
-
-          // Read last completed ICM file from ifs.stat file
-          while(std::getline(ifs_stat_file, ifs_line)) {  //get 1 row as a string
-             //fprintf(stderr,"Reading ifs.stat file\n");
-             //fflush(stderr);
-
-             std::istringstream iss(ifs_line);  //put line into stringstream
-             int ifs_word_count=0;
-             // Read fourth column from file
-             while(iss >> ifs_word) {  //read word by word
-                ifs_word_count++;
-                if (ifs_word_count==4) iter = ifs_word;
-                //fprintf(stderr,"count: %i\n",ifs_word_count);
-                //fprintf(stderr,"iter: %s\n",iter.c_str());
-             }
+       events = waitMonitorEvents(monitor);
+
+       // Check whether an upload point has been reached when ifs.stat changes or the model closes an output file
+       if (events & (EVENT_STAT|EVENT_OUTPUT)) {
+          // Read the steps completed since ifs.stat was last read
+          readIfsStat(ifs_stat);
+          // The step the model has reached
+          if (ifs_stat.last_step >= 0) current_iter = ifs_stat.last_step;
+          if (relaunched && ifs_stat.last_step >= 0) {
+             fprintf(stderr,"The relaunched model reached step %i %.2f seconds after the resume\n",ifs_stat.last_step,
+                     duration<double>(steady_clock::now() - relaunch_start).count());
+             relaunched = false;
           }
-          // Convert to seconds
-          current_iter = (std::stoi(iter)) * timestep_interval;
-
-          //fprintf(stderr,"Current iteration of model: %s\n",iter.c_str());
-          //fprintf(stderr,"timestep_interval: %i\n",timestep_interval);
-          //fprintf(stderr,"current_iter: %i\n",current_iter);
-          //fprintf(stderr,"last_upload: %i\n",last_upload);
-
-          // Upload a new upload file if the end of an upload_interval has been reached
-          if((( current_iter - last_upload ) >= (upload_interval * timestep_interval)) && (current_iter < total_length_of_simulation)) {
-             // Create an intermediate results zip file using BOINC zip
-             zfl.clear();
 
-             //fprintf(stderr,"total_count: %d\n",total_count);
-
-             boinc_begin_critical_section();
-
-             for (i = (last_upload / timestep_interval); i < (current_iter / timestep_interval); i++) {
-                //fprintf(stderr,"last_upload/timestep_interval: %i\n",(last_upload/timestep_interval));
-                //fprintf(stderr,"current_iter/timestep_interval: %i\n",(current_iter / timestep_interval));
-                //fprintf(stderr,"i: %s\n",(to_string(i)).c_str());
-
-                if (to_string(i).length() == 1) {
-                   second_part = "00000" + to_string(i);
-                }
-                else if (to_string(i).length() == 2) {
-                   second_part = "0000" + to_string(i);
-                }
-                else if (to_string(i).length() == 3) {
-                   second_part = "000" + to_string(i);
-                }
-                else if (to_string(i).length() == 4) {
-                   second_part = "00" + to_string(i);
-                }
-                else if (to_string(i).length() == 5) {
-                   second_part = "0" + to_string(i);
-                }
-                else if (to_string(i).length() == 6) {
-                   second_part = to_string(i);
-                }
-
-                if(fs::exists(slot_path+std::string("/ICMGG")+exptid+"+"+second_part)) {
-                   fprintf(stderr,"Adding to the zip: %s\n",(slot_path+std::string("/ICMGG")+exptid+"+"+second_part).c_str());
-                   zfl.push_back(slot_path+std::string("/ICMGG")+exptid+"+"+second_part);
-                }
-
-                if(fs::exists(slot_path+std::string("/ICMSH")+exptid+"+"+second_part)) {
-                   fprintf(stderr,"Adding to the zip: %s\n",(slot_path+std::string("/ICMSH")+exptid+"+"+second_part).c_str());
-                   zfl.push_back(slot_path+std::string("/ICMSH")+exptid+"+"+second_part);
-                }
+          updateProgress(progress,current_iter,handleProcess);
+
+          // Record the step rate of the OpenMP settings being timed once enough steps have been timed
+          if (tuning_trial && progress.measured_steps >= std::min(20,schedule.nstop/2) && progress.measured_seconds > 0) {
+             tuning.steps_per_second = progress.measured_steps / progress.measured_seconds;
+             fprintf(stderr,"The OpenMP settings being timed ran at %.4f steps per second\n",tuning.steps_per_second);
+             recordTuning(tuning_path,tuning_key,tuning);
+             tuning_trial = false;
+
+             // Rather than run the whole forecast on the settings being timed, switch to the fastest timed so far at
+             // the next restart dump, if the model fits in memory with them
+             FOOTPRINT fastest_footprint;
+             if (fastestTuning(tuning_path,tuning_key,tuning_ncpus,next_tuning) &&
+                 (next_tuning.nthreads != tuning.nthreads || next_tuning.schedule != tuning.schedule)) {
+                modelFootprint(config.grid_type,config.horiz_resolution,config.vert_resolution,next_tuning.nthreads,fastest_footprint);
+                tuning_switch = (memory_limit <= 0 || fastest_footprint.memory <= memory_limit);
+                if (tuning_switch)
+                   fprintf(stderr,"Switching to the fastest OpenMP settings, %i threads and OMP_SCHEDULE=%s at %.4f steps per "
+                           "second, at the next restart dump\n",next_tuning.nthreads,next_tuning.schedule.c_str(),
+                           next_tuning.steps_per_second);
              }
+          }
 
-             // If running under a BOINC client
-             if (!boinc_is_standalone()) {
-
-                if (zfl.size() > 0){
+          // Record each new restart dump in the journal
+          int restart_step = readRestartStep(slot_path);
+          if (restart_step > run_state.restart_step) {
+             run_state.restart_step = restart_step;
+             saveRunState(run_state);
+             if (tuning_switch) tuning_switch_due = true;
+             progress.checkpoint_cpu_seconds = progress.cpu_seconds;
+          }
 
-                   // Create the zipped upload file from the list of files added to zfl
-                   memset(upload_file, 0x00, sizeof(upload_file));
-                   std::sprintf(upload_file,"%s%s_%d.zip",project_path.c_str(),result_base_name,upload_file_number);
+          // Summarise the ICMGG files of the steps whose output is ready
+          while (!diag_params.empty() && next_diag_output < schedule.output_steps.size() &&
+                 outputReady(schedule.output_steps[next_diag_output])) {
+             std::string icmgg_file = icmFileName(slot_path,"ICMGG",exptid,schedule.output_steps[next_diag_output++]);
+             if (fs::exists(icmgg_file)) queueDiagnostics(diag_worker,icmgg_file);
+          }
 
-                   fprintf(stderr,"Zipping up file: %s\n",upload_file);
-                   retval = boinc_zip(ZIP_IT,upload_file,&zfl);
+          // Append the output files of the steps whose output is ready to the zip of their upload interval
+          while (next_append < schedule.output_steps.size() && outputReady(schedule.output_steps[next_append])) {
+             int output_step = schedule.output_steps[next_append];
+             int append_number = 1 + (int) std::count_if(schedule.upload_steps.begin(),schedule.upload_steps.end(),
+                                                          [output_step](int upload_step) { return upload_step <= output_step; });
+             UPLOAD_JOB append_job = makeUploadJob(append_number);
+             append_job.finish = false;
+
+             std::string icmgg_file = icmFileName(slot_path,"ICMGG",exptid,output_step);
+             std::string icmsh_file = icmFileName(slot_path,"ICMSH",exptid,output_step);
+
+             // A resumed run writes again the output since its restart dump, the steps in zips already finished are removed
+             if (append_number < upload_file_number) {
+                std::error_code ec;
+                bool removed = fs::remove(icmgg_file,ec);
+                if (fs::remove(icmsh_file,ec) || removed)
+                   fprintf(stderr,"Removing the output of step %i, it is already in upload file %i\n",output_step,append_number);
+                monitor.closed_outputs.erase(fs::path(icmgg_file).filename().string());
+                monitor.closed_outputs.erase(fs::path(icmsh_file).filename().string());
+                next_append++;
+                continue;
+             }
 
-                   if (retval) {
-                      fprintf(stderr,"..Creating the zipped upload file failed\n");
-                      boinc_end_critical_section();
-                      return retval;
-                   }
-                   else {
-                      // Files have been successfully zipped, they can now be deleted
-                      for (j = 0; j < (int) zfl.size(); ++j) {
-                         // Delete the zipped file
-                         fs::remove(zfl[j].c_str());
-                      }
-                   }
-                   
-                   // Upload the file. In BOINC the upload file is the logical name, not the physical name
-                   upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
-                   fprintf(stderr,"Uploading file: %s\n",upload_file_name.c_str());
-                   fflush(stderr);
-                   sleep_until(system_clock::now() + seconds(20));
-                   boinc_upload_file(upload_file_name);
-                   retval = boinc_upload_status(upload_file_name);
-                   if (retval) {
-                      fprintf(stderr,"Finished the upload of the result file: %s\n",upload_file_name.c_str());
-                      fflush(stderr);
-                   }
-                }
-                boinc_end_critical_section();
-                last_upload = current_iter; 
+             if(fs::exists(icmgg_file)) {
+                fprintf(stderr,"Adding to the zip: %s\n",icmgg_file.c_str());
+                append_job.files.push_back(icmgg_file);
              }
 
-             // Else running in standalone
-             else {
-                upload_file_name = std::string("openifs_") + unique_member_id + std::string("_") + start_date + std::string("_") + \
-                              fclen + std::string("_") + batchid + std::string("_") + wuid + std::string("_") + \
-                              to_string(upload_file_number) + std::string(".zip");
-                fprintf(stderr,"The current upload_file_name is: %s\n",upload_file_name.c_str());
-
-                // Create the zipped upload file from the list of files added to zfl
-                memset(upload_file, 0x00, sizeof(upload_file));
-                std::sprintf(upload_file,"%s%s",project_path.c_str(),upload_file_name.c_str());
-                if (zfl.size() > 0){
-                   retval = boinc_zip(ZIP_IT,upload_file,&zfl);
-
-                   if (retval) {
-                      fprintf(stderr,"..Creating the zipped upload file failed\n");
-                      boinc_end_critical_section();
-                      return retval;
-                   }
-                   else {
-                      // Files have been successfully zipped, they can now be deleted
-                      for (j = 0; j < (int) zfl.size(); ++j) {
-                         // Delete the zipped file
-                         fs::remove(zfl[j].c_str());
-                      }
-                   }
-                }
-                last_upload = current_iter;
+             if(fs::exists(icmsh_file)) {
+                fprintf(stderr,"Adding to the zip: %s\n",icmsh_file.c_str());
+                append_job.files.push_back(icmsh_file);
              }
-             boinc_end_critical_section();
-             upload_file_number++;
+
+             // If the packaging queue is full the files are appended on a later pass
+             if (!append_job.files.empty() && !queueUpload(packager,append_job)) break;
+             monitor.closed_outputs.erase(fs::path(icmgg_file).filename().string());
+             monitor.closed_outputs.erase(fs::path(icmsh_file).filename().string());
+             next_append++;
           }
-          count = 0;
 
-          // Closing ifs.stat file access
-          ifs_stat_file.close();
+          // Finish the upload file once the end of its upload interval has been reached and its files are appended
+          if ((upload_file_number <= (int) schedule.upload_steps.size()) &&
+              (current_iter >= schedule.upload_steps[upload_file_number-1])) {
+             bool appended = (next_append >= schedule.output_steps.size()) ||
+                             (schedule.output_steps[next_append] >= schedule.upload_steps[upload_file_number-1]);
+             if (appended && queueUpload(packager,makeUploadJob(upload_file_number))) upload_file_number++;
+          }
        }
 
+       // Hand the packaged upload files to the BOINC client
+       while (takeFinishedUpload(packager,finished_job)) {
+          uploadSummary(finished_job,disk_budget);
+          if (!finished_job.upload_file_name.empty()) {
+             fprintf(stderr,"Uploading file: %s\n",finished_job.upload_file_name.c_str());
+             fflush(stderr);
+             boinc_upload_file(finished_job.upload_file_name);
+             disk_budget.uploading.emplace_back(finished_job.upload_file,finished_job.upload_file_name);
+          }
+          run_state.last_upload = finished_job.upload_file_number;
+          saveRunState(run_state);
+       }
+       if (packager.retval) {
+          fprintf(stderr,"..Creating the zipped upload file failed, ending the child process\n");
+          fflush(stderr);
+          kill(handleProcess,SIGKILL);
+          closeMonitorEvents(monitor);
+          stopPackager(packager);
+          return packager.retval;
+       }
 
-       // Calculate the fraction done
-       getrusage(RUSAGE_SELF,&usage); //Return resource usage measurement
-       tv_sec = usage.ru_utime.tv_sec; //Time spent executing in user mode (seconds)
-       tv_usec = usage.ru_utime.tv_usec; //Time spent executing in user mode (microseconds)
-       cpu_time = tv_sec+(tv_usec/1000000); //Convert to seconds
-       fraction_done = (cpu_time-0.96)/(time_per_fclen*atoi(fclen.c_str()));
+       if (!(events & (EVENT_TIMER|EVENT_CHILD))) continue;
 
-       //fprintf(stderr,"tv_sec: %.5f\n",tv_sec);
-       //fprintf(stderr,"tv_usec: %.5f\n",(tv_usec/1000000));
-       //fprintf(stderr,"cpu_time: %1.5f\n",cpu_time);
-       //fprintf(stderr,"fraction_done: %.6f\n",fraction_done);
+       // Provide the fraction done and the CPU time of the model to the BOINC client,
+       // this is necessary for the percentage bar on the client and its runtime estimates
+       if (events & EVENT_TIMER) reportProgress(progress,handleProcess);
 
-       // Provide the fraction done to the BOINC client, 
-       // this is necessary for the percentage bar on the client
-       boinc_fraction_done(fraction_done);
-	    
        process_status = checkChildStatus(handleProcess,process_status);
-       process_status = checkBOINCStatus(handleProcess,process_status);
+       if (events & EVENT_TIMER) {
+          auto status_start = steady_clock::now();
+          process_status = checkBOINCStatus(handleProcess,process_status,suspend_policy);
+          // A suspend is not counted in the time of the step
+          if (steady_clock::now() - status_start > seconds(2)) progress.rebase = true;
+       }
+
+       // End the model at the restart dump following an autotune trial and relaunch it with the fastest settings
+       if (tuning_switch_due && process_status == 0) {
+          fprintf(stderr,"Relaunching the model from the restart dump at step %i with %i threads and OMP_SCHEDULE=%s\n",
+                  run_state.restart_step,next_tuning.nthreads,next_tuning.schedule.c_str());
+          fflush(stderr);
+          kill(handleProcess,SIGKILL);
+          waitpid(handleProcess,NULL,0);
+          tuning = next_tuning;
+          NTHREADS = tuning.nthreads;
+          progress.nthreads = NTHREADS;
+          modelFootprint(config.grid_type,config.horiz_resolution,config.vert_resolution,NTHREADS,footprint);
+          setenv("OMP_NUM_THREADS",std::to_string(NTHREADS).c_str(),1);
+          setenv("OMP_SCHEDULE",tuning.schedule.c_str(),1);
+          setenv("OMP_STACKSIZE",tuning.stacksize.c_str(),1);
+          if (NTHREADS > 1 && NTHREADS >= usableCores(dataBOINC)) {
+             setenv("OMP_PLACES","cores",1);
+             setenv("OMP_PROC_BIND","close",1);
+          }
+          else {
+             unsetenv("OMP_PLACES");
+             unsetenv("OMP_PROC_BIND");
+          }
+          if (!config.launch_profile.empty()) findLaunchProfile(config.launch_profile,NTHREADS,launch_profile);
+          tuning_switch = false;
+          tuning_switch_due = false;
+          process_status = 5;
+       }
+
+       // Relaunch the model from its restart dump after it was ended during a suspend or to switch its OpenMP
+       // settings, the output it writes again is caught by appending the output steps from the start
+       if (process_status == 5) {
+          handleProcess = launchProcess(slot_path,app_step.install_path.c_str(),strCmd.c_str(),exptid.c_str(),launch_profile);
+          process_status = (handleProcess > 0) ? 0 : 3;
+          suspend_policy.released = false;
+          run_state.restart_step = readRestartStep(slot_path);
+          current_iter = std::max(run_state.restart_step,0);
+          launch_step = current_iter;
+          skipIfsStat(ifs_stat);
+          next_append = 0;
+          monitor.closed_outputs.clear();
+          relaunch_start = steady_clock::now();
+          relaunched = true;
+          progress.last_step = current_iter;
+          progress.rebase = true;
+       }
+       if ((events & EVENT_TIMER) && process_status == 0) {
+          checkDiskBudget(disk_budget,handleProcess,packagerBusy(packager));
+          checkPressure(pressure,handleProcess,packager,disk_budget.paused);
+       }
+       if ((events & EVENT_TIMER) && process_status == 0) takeSample(sampler,handleProcess,current_iter);
+       if (disk_budget.paused || pressure.level >= 3) progress.rebase = true;
+    }
+    closeMonitorEvents(monitor);
+    if (pressure.available) {
+       if (pressure.level > 0) pressure.level_seconds[pressure.level] += duration<double>(steady_clock::now() - pressure.level_start).count();
+       fprintf(stderr,"Host pressure peaked at cpu %.1f%%, memory %.1f%%, io %.1f%%, the packaging was deferred for %.0f seconds, "
+               "at idle CPU priority for %.0f seconds and the model paused for %.0f seconds\n",pressure.peak_cpu,
+               pressure.peak_memory,pressure.peak_io,pressure.level_seconds[1],pressure.level_seconds[2],pressure.level_seconds[3]);
+    }
+    if (progress.step_seconds > 0) {
+       fprintf(stderr,"The model ran at %.4f steps per second on %i threads, %.4f steps per second per thread\n",
+               1 / progress.step_seconds,progress.nthreads,1 / (progress.step_seconds * progress.nthreads));
+    }
+
+    // Record the effect of the launch profile, the peak resident memory is that of the largest model process to end
+    struct rusage child_usage;
+    if (getrusage(RUSAGE_CHILDREN,&child_usage) == 0) {
+       #ifdef __APPLE__ // macOS
+          double peak_rss = child_usage.ru_maxrss / 1.0e6;      // in bytes
+       #else // Linux
+          double peak_rss = child_usage.ru_maxrss / 1.0e3;      // in kilobytes
+       #endif
+       fprintf(stderr,"Launch profile %s: %.4f steps per second, peak RSS %.0f MB against a footprint of %.0f MB\n",
+               launch_profile.name.c_str(),progress.measured_seconds > 0 ? progress.measured_steps / progress.measured_seconds : 0.0,
+               peak_rss,footprint.memory/1e6);
     }
 
 
 
     boinc_begin_critical_section();
 
-    // Create the final results zip file
+    // Wait for the queued upload files to be packaged and hand them to the BOINC client
+    stopPackager(packager);
+    while (takeFinishedUpload(packager,finished_job)) {
+       uploadSummary(finished_job,disk_budget);
+       if (!finished_job.upload_file_name.empty()) {
+          fprintf(stderr,"Uploading file: %s\n",finished_job.upload_file_name.c_str());
+          boinc_upload_file(finished_job.upload_file_name);
+       }
+       run_state.last_upload = finished_job.upload_file_number;
+       saveRunState(run_state);
+    }
+    if (packager.retval) {
+       fprintf(stderr,"..Creating the zipped upload file failed\n");
+       boinc_end_critical_section();
+       return packager.retval;
+    }
 
-    zfl.clear();
+    // After a quit request the output since the last upload is left in the slot and the partial zip for the run to resume
+    if (process_status == 2) {
+       fprintf(stderr,"Leaving the run to be resumed from the restart dump at step %i\n",run_state.restart_step);
+       fflush(stderr);
+       boinc_end_critical_section();
+       return 0;
+    }
+
+    // Create the final results zip file
+    UPLOAD_JOB final_job = makeUploadJob(upload_file_number);
     std::string node_file = slot_path + std::string("/NODE.001_01");
-    zfl.push_back(node_file);
+    final_job.files.push_back(node_file);
     std::string ifsstat_file = slot_path + std::string("/ifs.stat");
-    zfl.push_back(ifsstat_file);
+    final_job.files.push_back(ifsstat_file);
+    std::string summary_file = slot_path + std::string("/resources.txt");
+    if (closeSampler(sampler,summary_file) == 0) {
+       final_job.files.push_back(summary_file);
+       final_job.files.push_back(sampler.ring_path);
+    }
 
     // Read the remaining list of files from the slots directory and add the matching files to the list of files for the zip
     dirp = opendir(slot_path);
@@ -846,72 +1488,40 @@ int main(int argc, char** argv) {
           regcomp(&regex,"\\+",0);
 
           if (!regexec(&regex,dir->d_name,(size_t) 0,NULL,0)) {
-            zfl.push_back(slot_path+std::string("/")+dir->d_name);
+            final_job.files.push_back(slot_path+std::string("/")+dir->d_name);
             fprintf(stderr,"Adding to the zip: %s\n",(slot_path+std::string("/")+dir->d_name).c_str());
           }
         }
         closedir(dirp);
     }
 
-    // If running under a BOINC client
-    if (!boinc_is_standalone()) {
-       if (zfl.size() > 0){
-
-          // Create the zipped upload file from the list of files added to zfl
-          memset(upload_file, 0x00, sizeof(upload_file));
-          std::sprintf(upload_file,"%s%s_%d.zip",project_path.c_str(),result_base_name,upload_file_number);
-
-          fprintf(stderr,"Zipping up file: %s\n",upload_file);
-          retval = boinc_zip(ZIP_IT,upload_file,&zfl);
-
-          if (retval) {
-             fprintf(stderr,"..Creating the zipped upload file failed\n");
-             boinc_end_critical_section();
-             return retval;
-          }
-          else {
-             // Files have been successfully zipped, they can now be deleted
-             for (j = 0; j < (int) zfl.size(); ++j) {
-                // Delete the zipped file
-                fs::remove(zfl[j].c_str());
-             }
-          }
+    // When running standalone the files are kept in the working directory
+    final_job.remove_files = !boinc_is_standalone();
+    fprintf(stderr,"Zipping up file: %s\n",final_job.upload_file.c_str());
+    retval = packageUpload(packager,final_job);
+    if (retval) {
+       fprintf(stderr,"..Creating the zipped upload file failed\n");
+       boinc_end_critical_section();
+       return retval;
+    }
 
-          // Upload the file. In BOINC the upload file is the logical name, not the physical name
-          upload_file_name = std::string("upload_file_") + std::to_string(upload_file_number) + std::string(".zip");
-          fprintf(stderr,"Uploading file: %s\n",upload_file_name.c_str());
+    // If running under a BOINC client upload the file
+    if (!boinc_is_standalone() && !final_job.upload_file_name.empty()) {
+       uploadSummary(final_job,disk_budget);
+       fprintf(stderr,"Uploading file: %s\n",final_job.upload_file_name.c_str());
+       fflush(stderr);
+       boinc_upload_file(final_job.upload_file_name);
+       retval = boinc_upload_status(final_job.upload_file_name);
+       if (retval) {
+          fprintf(stderr,"Finished the upload of the result file\n");
           fflush(stderr);
-          sleep_until(system_clock::now() + seconds(20));
-          boinc_upload_file(upload_file_name);
-          retval = boinc_upload_status(upload_file_name);
-          if (retval) {
-             fprintf(stderr,"Finished the upload of the result file\n");
-             fflush(stderr);
-          }
        }
-       boinc_end_critical_section();
-       last_upload = current_iter;
-    }
-    // Else running in standalone
-    else {
-       upload_file_name = std::string("openifs_") + unique_member_id + std::string("_") + start_date + std::string("_") + \
-                          fclen + std::string("_") + batchid + std::string("_") + wuid + std::string("_") + \
-                          to_string(upload_file_number) + std::string(".zip");
-       fprintf(stderr,"The file upload_file_name is: %s\n",upload_file_name.c_str());
-
-       // Create the zipped upload file from the list of files added to zfl
-       memset(upload_file, 0x00, sizeof(upload_file));
-       std::sprintf(upload_file,"%s%s",project_path.c_str(),upload_file_name.c_str());
-       if (zfl.size() > 0){
-          retval = boinc_zip(ZIP_IT,upload_file,&zfl);
-          if (retval) {
-             fprintf(stderr,"..Creating the zipped upload file failed\n");
-             boinc_end_critical_section();
-             return retval;
-           }
-        }
     }
 	
+    // The run has ended and is not to be resumed
+    std::error_code ec;
+    fs::remove(run_state.path,ec);
+
     // if finished normally
     if (process_status == 1){
       boinc_end_critical_section();
@@ -969,8 +1579,9 @@ int checkChildStatus(long handleProcess, int process_status) {
 }
 
 
-int checkBOINCStatus(long handleProcess, int process_status) {
+int checkBOINCStatus(long handleProcess, int process_status, SUSPEND_POLICY &policy) {
     BOINC_STATUS status;
+    int stat;
     boinc_get_status(&status);
 
     // If a quit, abort or no heartbeat has been received from the BOINC client, end child process
@@ -992,7 +1603,7 @@ int checkBOINCStatus(long handleProcess, int process_status) {
        fprintf(stderr,"No heartbeat received from BOINC client, ending the child process\n");
        fflush(stderr);
        kill(handleProcess,SIGKILL);
-       process_status = 1;
+       process_status = 2;   // the client has gone, the run is resumed when it restarts
        return process_status;
     }
     // Else if BOINC client is suspended, suspend child process and periodically check BOINC client status
@@ -1001,33 +1612,57 @@ int checkBOINCStatus(long handleProcess, int process_status) {
           fprintf(stderr,"Suspend request received from the BOINC client, suspending the child process\n");
           fflush(stderr);
           kill(handleProcess,SIGSTOP);
+          auto suspend_start = steady_clock::now();
 
           while (status.suspended) {
              boinc_get_status(&status);
              if (status.quit_request) {
                 fprintf(stderr,"Quit request received from the BOINC client, ending the child process\n");
                 fflush(stderr);
-                kill(handleProcess,SIGKILL);
+                if (!policy.released) kill(handleProcess,SIGKILL);
                 process_status = 2;
                 return process_status;
              }
              else if (status.abort_request) {
                 fprintf(stderr,"Abort request received from the BOINC client, ending the child process\n");
                 fflush(stderr);
-                kill(handleProcess,SIGKILL);
+                if (!policy.released) kill(handleProcess,SIGKILL);
                 process_status = 1;
                 return process_status;
              }
              else if (status.no_heartbeat) {
                 fprintf(stderr,"No heartbeat received from the BOINC client, ending the child process\n");
                 fflush(stderr);
-                kill(handleProcess,SIGKILL);
-                process_status = 1;
+                if (!policy.released) kill(handleProcess,SIGKILL);
+                process_status = 2;
                 return process_status;
              }
+
+             // After the grace period, or sooner if the host is short of memory, end the model to release its memory
+             // if it can be relaunched from a restart dump
+             double suspended = duration<double>(steady_clock::now() - suspend_start).count();
+             if (!policy.released && policy.grace > 0 && (suspended >= policy.grace || memoryPressure())) {
+                int restart_step = readRestartStep(policy.slot_path);
+                if (restart_step >= 0) {
+                   kill(handleProcess,SIGKILL);
+                   waitpid(handleProcess,&stat,0);
+                   policy.released = true;
+                   fprintf(stderr,"Ended the suspended child process to release its memory %.2f seconds after the suspend, "
+                                  "it is relaunched from the restart dump at step %i\n",
+                           duration<double>(steady_clock::now() - suspend_start).count(),restart_step);
+                   fflush(stderr);
+                }
+             }
              sleep_until(system_clock::now() + seconds(1));
           }
-          // Resume child process
+
+          // Relaunch an ended child process, or resume the stopped one
+          if (policy.released) {
+             fprintf(stderr,"Resuming, the child process is to be relaunched\n");
+             fflush(stderr);
+             process_status = 5;
+             return process_status;
+          }
           fprintf(stderr,"Resuming the child process\n");
           fflush(stderr);
           kill(handleProcess,SIGCONT);
@@ -1038,11 +1673,95 @@ int checkBOINCStatus(long handleProcess, int process_status) {
 }
 
 
-long launchProcess(const char* slot_path,const char* strCmd,const char* exptid) {
+// Whether the host is short of memory, with less than a tenth of its memory available
+bool memoryPressure() {
+    double total = memInfo("MemTotal"), available = memInfo("MemAvailable");
+    return total > 0 && available >= 0 && available < 0.1 * total;
+}
+
+// Return a value from /proc/meminfo in bytes, or -1 if it is not available
+double memInfo(const char *name) {
+    #ifndef __APPLE__ // Linux
+       std::ifstream meminfo("/proc/meminfo");
+       std::string line, key;
+       double value;
+       while (std::getline(meminfo,line)) {
+          std::istringstream fields(line);
+          if ((fields >> key >> value) && key == std::string(name) + std::string(":")) return value * 1024;
+       }
+    #endif
+    return -1;
+}
+
+
+// The memory and disk of a run from a table of the linear grid with 91 levels, scaled by the grid points of the
+// grid type, the levels and the threads. The table is shared with openifs_wu_submit.py and is refined from the
+// peak RSS logged at the end of each run.
+void modelFootprint(const std::string &grid_type, int horiz_resolution, int vert_resolution, int nthreads, FOOTPRINT &footprint) {
+    // The resolution, the memory of the model and of each thread in MB, and the disk in MB
+    static const double table[][4] = {{63,700,100,2000},      {95,1000,120,2500},     {159,1800,200,4000},
+                                      {255,3800,350,5000},    {319,5500,450,7000},    {399,8000,600,9000},
+                                      {511,12500,800,12000},  {639,19000,1000,16000}, {799,29000,1300,20000},
+                                      {1279,72000,2500,40000}};
+    const int nrows = sizeof(table) / sizeof(table[0]);
+    int row = 0;
+    while (row < nrows-1 && table[row][0] < horiz_resolution) row++;
+    double scale = (horiz_resolution > table[nrows-1][0]) ? pow(horiz_resolution / table[nrows-1][0],2) : 1;
+
+    // The grid points relative to the linear reduced grid
+    double grid = 1;
+    if (grid_type == "_2") grid = 2.25;
+    else if (grid_type == "_3") grid = 3.9;
+    else if (grid_type == "_4") grid = 3.05;
+    else if (grid_type == "_full") grid = 1.48;
+    if (vert_resolution > 0) scale *= vert_resolution / 91.0;
+
+    footprint.memory = (table[row][1] + table[row][2] * std::max(nthreads,1)) * grid * scale * 1e6;
+    footprint.disk = table[row][3] * grid * scale * 1e6;
+}
+
+// The memory the model can use, the lower of the memory available and the share allowed by the BOINC preferences
+// while the computer is in use, or 0 if neither is known
+double memoryLimit(const APP_INIT_DATA &dataBOINC) {
+    double limit = memInfo("MemAvailable");
+    double allowed = dataBOINC.host_info.m_nbytes * dataBOINC.global_prefs.ram_max_used_busy_frac;
+    if (allowed > 0 && (limit <= 0 || allowed < limit)) limit = allowed;
+    return std::max(limit,0.0);
+}
+
+// Find a launch profile by name, returns 1 if it is not known:
+//   default      the glibc malloc defaults
+//   malloc       an arena per model thread, with higher trim and mmap thresholds so large arrays are reused
+//   thp          as malloc, with the heap advised for transparent huge pages
+//   hugetlb      as malloc, with the heap in reserved huge pages where the host has them
+//   jemalloc     preload libjemalloc from the app's lib folder
+//   tcmalloc     preload libtcmalloc_minimal from the app's lib folder
+int findLaunchProfile(const std::string &name, int nthreads, LAUNCH_PROFILE &profile) {
+    std::string malloc_tunables = std::string("glibc.malloc.arena_max=") + std::to_string(std::max(nthreads,1)) +
+                                  std::string(":glibc.malloc.trim_threshold=268435456:glibc.malloc.mmap_threshold=33554432");
+    profile = LAUNCH_PROFILE();
+    profile.name = name;
+
+    if (name == "default") return 0;
+    else if (name == "malloc") profile.glibc_tunables = malloc_tunables;
+    else if (name == "thp") {
+       profile.glibc_tunables = malloc_tunables + std::string(":glibc.malloc.hugetlb=1");
+       profile.thp = true;
+    }
+    else if (name == "hugetlb") profile.glibc_tunables = malloc_tunables + std::string(":glibc.malloc.hugetlb=2");
+    else if (name == "jemalloc") profile.preload = "libjemalloc";
+    else if (name == "tcmalloc") profile.preload = "libtcmalloc_minimal";
+    else return 1;
+    return 0;
+}
+
+long launchProcess(const char* slot_path,const char* app_path,const char* strCmd,const char* exptid,
+                   const LAUNCH_PROFILE &profile) {
     int retval = 0;
     long handleProcess;
 
     fprintf(stderr,"slot_path: %s\n",slot_path);
+    fprintf(stderr,"app_path: %s\n",app_path);
     fprintf(stderr,"strCmd: %s\n",strCmd);
     fprintf(stderr,"exptid: %s\n",exptid);
     fflush(stderr);
@@ -1055,8 +1774,13 @@ long launchProcess(const char* slot_path,const char* strCmd,const char* exptid)
        }
        case 0: { //The child process
           char *pathvar;
+          // The controller blocks SIGCHLD, restore the default signal mask for the model
+          sigset_t child_mask;
+          sigemptyset(&child_mask);
+          pthread_sigmask(SIG_SETMASK,&child_mask,NULL);
+
           // Set the GRIB_SAMPLES_PATH environmental variable
-          std::string GRIB_SAMPLES_var = std::string("GRIB_SAMPLES_PATH=") + slot_path + \
+          std::string GRIB_SAMPLES_var = std::string("GRIB_SAMPLES_PATH=") + app_path + \
                                          std::string("/eccodes/ifs_samples/grib1_mlgrib2");
           if (putenv((char *)GRIB_SAMPLES_var.c_str())) {
             fprintf(stderr,"..Setting the GRIB_SAMPLES_PATH failed\n");
@@ -1065,7 +1789,7 @@ long launchProcess(const char* slot_path,const char* strCmd,const char* exptid)
           fprintf(stderr,"The GRIB_SAMPLES_PATH environmental variable is: %s\n",pathvar);
 
           // Set the GRIB_DEFINITION_PATH environmental variable
-          std::string GRIB_DEF_var = std::string("GRIB_DEFINITION_PATH=") + slot_path + \
+          std::string GRIB_DEF_var = std::string("GRIB_DEFINITION_PATH=") + app_path + \
                                      std::string("/eccodes/definitions");
           if (putenv((char *)GRIB_DEF_var.c_str())) {
             fprintf(stderr,"..Setting the GRIB_DEFINITION_PATH failed\n");
@@ -1073,6 +1797,36 @@ long launchProcess(const char* slot_path,const char* strCmd,const char* exptid)
           pathvar = getenv("GRIB_DEFINITION_PATH");
           fprintf(stderr,"The GRIB_DEFINITION_PATH environmental variable is: %s\n",pathvar);
 
+          // Apply the launch profile, the malloc tunables and huge pages are only available with glibc on Linux
+          #ifndef __APPLE__ // Linux
+             std::string GLIBC_TUNABLES_var = std::string("GLIBC_TUNABLES=") + profile.glibc_tunables;
+             if (!profile.glibc_tunables.empty()) {
+                if (putenv((char *)GLIBC_TUNABLES_var.c_str())) fprintf(stderr,"..Setting the GLIBC_TUNABLES failed\n");
+                fprintf(stderr,"The GLIBC_TUNABLES environmental variable is: %s\n",getenv("GLIBC_TUNABLES"));
+             }
+             if (profile.thp && prctl(PR_SET_THP_DISABLE,0,0,0,0) != 0) {
+                fprintf(stderr,"..Enabling transparent huge pages failed\n");
+             }
+             std::string PRELOAD_var = std::string("LD_PRELOAD=") + app_path + std::string("/lib/") + profile.preload + std::string(".so");
+          #else // macOS
+             if (!profile.glibc_tunables.empty() || profile.thp) {
+                fprintf(stderr,"..The malloc tunables and huge pages of the launch profile are not available on macOS\n");
+             }
+             std::string PRELOAD_var = std::string("DYLD_INSERT_LIBRARIES=") + app_path + std::string("/lib/") + profile.preload + std::string(".dylib");
+          #endif
+          if (!profile.preload.empty()) {
+             std::string preload_path = PRELOAD_var.substr(PRELOAD_var.find('=')+1);
+             if (access(preload_path.c_str(),R_OK) != 0) {
+                fprintf(stderr,"..The allocator %s is not in the app folder, using the default allocator\n",preload_path.c_str());
+             }
+             else if (putenv((char *)PRELOAD_var.c_str())) {
+                fprintf(stderr,"..Setting the preloaded allocator failed\n");
+             }
+             else {
+                fprintf(stderr,"Preloading the allocator: %s\n",preload_path.c_str());
+             }
+          }
+
           fprintf(stderr,"Executing the command: %s\n",strCmd);   
           retval = execl(strCmd,strCmd,"-e",exptid,NULL);
 
@@ -1110,70 +1864,3022 @@ std::string getTag(const std::string &filename) {
     }
 }
 
-// Alternative method to unzip a folder (macOS only)
-#ifdef __APPLE__ // macOS
-int unzip_file(const char *file_name) {
+// Unzip a zip file into the destination folder, spreading the entries over the extraction threads
+int unzip_file(const char *file_name, const char *dest_dir, int nthreads, const ENTRY_FILTER &filter) {
     struct zip *opened_file;
-    struct zip_file *zf;
     struct zip_stat zip_position;
-    char buf[100];
-    int err,i,len,fd;
-    long long sum;
-
-    int retval = 0;
+    std::vector<std::pair<zip_uint64_t,zip_uint64_t>> entries;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_entry(0);
+    std::atomic<int> retval(0);
+    std::error_code ec;
+    int err,i,len;
+    zip_uint64_t total_bytes = 0;
+    auto unzip_start = steady_clock::now();
 
     fprintf(stderr,"Unzipping file: %s\n",file_name);
     if ((opened_file = zip_open(file_name, 0, &err)) == NULL) {
        fprintf(stderr,"..Cannot open zip file: %s\n",file_name);
-       retval=1;
+       return 1;
     }
 
+    // Create the folders first and list the files to extract
     for (i = 0; i < zip_get_num_entries(opened_file,0); i++) {
        if (zip_stat_index(opened_file,i,0,&zip_position) == 0) {
           len = strlen(zip_position.name);
 
+          // An entry named by an absolute path or with a '..' component would be written outside the destination,
+          // into the cache or the app install that later tasks link from
+          fs::path relative_name(zip_position.name);
+          bool unsafe = (len == 0 || relative_name.is_absolute() || zip_position.name[0] == '/');
+          for (auto &component : relative_name) {
+             if (component == "..") unsafe = true;
+          }
+          if (unsafe) {
+             fprintf(stderr,"..The zip file %s has an entry outside its folder: %s\n",file_name,zip_position.name);
+             retval=1;
+             break;
+          }
+          fs::path entry_name = fs::path(dest_dir) / zip_position.name;
+
           if (zip_position.name[len - 1] == '/') {
-             if (mkdir(zip_position.name, 0755) < 0) {
-                fprintf(stderr, "..Failed to create directory: %s\n",zip_position.name);
-                retval=1;
-             }
-          } else {
-             zf = zip_fopen_index(opened_file, i, 0);
-             if (!zf) {
-                fprintf(stderr, "..Failed to open zip index\n");
+             fs::create_directories(entry_name,ec);
+             if (ec) {
+                fprintf(stderr, "..Failed to create directory: %s\n",entry_name.c_str());
                 retval=1;
              }
+          } else if (!filter || filter(zip_position.name)) {
+             fs::create_directories(entry_name.parent_path(),ec);
+             entries.push_back(std::make_pair(zip_position.size,(zip_uint64_t) i));
+             total_bytes += zip_position.size;
+          }
+       } else {
+          fprintf(stderr,"..File %s line %d\n",__FILE__,__LINE__);
+          retval=1;
+       }
+    }
+    zip_discard(opened_file);
+    if (retval) return retval;
+
+    // Extract the largest entries first so that the threads finish at about the same time
+    std::sort(entries.begin(),entries.end(),std::greater<std::pair<zip_uint64_t,zip_uint64_t>>());
+    nthreads = std::max(1,std::min(nthreads,(int) entries.size()));
+
+    // Each thread reads through its own handle on the zip file
+    for (i = 0; i < nthreads; i++) {
+       workers.emplace_back([&]() {
+          int thread_err;
+          struct zip *thread_file = zip_open(file_name, 0, &thread_err);
+          if (thread_file == NULL) {
+             fprintf(stderr,"..Cannot open zip file: %s\n",file_name);
+             retval = 1;
+             return;
+          }
+          std::vector<char> buf(4*1024*1024);
+          size_t entry;
+          while (!retval && (entry = next_entry++) < entries.size()) {
+             if (unzip_entry(thread_file,entries[entry].second,dest_dir,buf)) retval = 1;
+          }
+          zip_discard(thread_file);
+       });
+    }
+    for (auto &worker : workers) worker.join();
+
+    // Report the extraction throughput
+    double unzip_seconds = duration<double>(steady_clock::now() - unzip_start).count();
+    if (!retval) fprintf(stderr,"Unzipped %llu bytes from %s in %.2f seconds (%.1f MB/s)\n",(unsigned long long) total_bytes,
+                         stripPath(file_name),unzip_seconds,(total_bytes/1048576.0)/std::max(unzip_seconds,1e-6));
+    return retval;
+}
+
+// Extract a single file from an opened zip file into the destination folder, verifying its CRC as it is written
+int unzip_entry(struct zip *opened_file, zip_uint64_t index, const char *dest_dir, std::vector<char> &buf) {
+    struct zip_file *zf;
+    struct zip_stat zip_position;
+    zip_int64_t len;
+    ssize_t written;
+    uLong crc;
+    long long sum;
+    int fd,retval = 0;
+
+    if (zip_stat_index(opened_file,index,0,&zip_position) != 0) {
+       fprintf(stderr,"..File %s line %d\n",__FILE__,__LINE__);
+       return 1;
+    }
+    std::string entry_name = std::string(dest_dir) + std::string("/") + zip_position.name;
+
+    zf = zip_fopen_index(opened_file, index, 0);
+    if (!zf) {
+       fprintf(stderr,"..Failed to open zip index: %s\n",zip_strerror(opened_file));
+       return 1;
+    }
+
+    fd = open(entry_name.c_str(),O_RDWR|O_TRUNC|O_CREAT,0755);
+    if (fd < 0) {
+       fprintf(stderr,"..Failed to open file in zip\n");
+       zip_fclose(zf);
+       return 1;
+    }
+
+    // Reserve the space for the file up front so that it is laid out contiguously
+    #ifndef __APPLE__ // Linux
+       if (zip_position.size > 0 && posix_fallocate(fd,0,(off_t) zip_position.size) != 0) {
+          fprintf(stderr,"..Failed to allocate %llu bytes for: %s\n",(unsigned long long) zip_position.size,entry_name.c_str());
+          close(fd);
+          zip_fclose(zf);
+          return 1;
+       }
+    #endif
+
+    sum = 0;
+    crc = crc32(0L,Z_NULL,0);
+    while (!retval && sum != (long long) zip_position.size) {
+       len = zip_fread(zf, buf.data(), buf.size());
+       if (len <= 0) {
+          fprintf(stderr,"..Failed to read %s from the zip\n",zip_position.name);
+          retval = 1;
+          break;
+       }
+       crc = crc32(crc,(const Bytef*) buf.data(),(uInt) len);
+
+       // Write out the whole buffer, handling short writes
+       for (zip_int64_t offset = 0; offset < len; offset += written) {
+          written = write(fd, buf.data() + offset, len - offset);
+          if (written < 0) {
+             if (errno == EINTR) { written = 0; continue; }
+             fprintf(stderr,"..Failed to write: %s\n",entry_name.c_str());
+             retval = 1;
+             break;
+          }
+       }
+       sum += len;
+    }
+
+    if (!retval && crc != zip_position.crc) {
+       fprintf(stderr,"..CRC mismatch for %s in the zip\n",zip_position.name);
+       retval = 1;
+    }
+    if (close(fd) != 0) retval = 1;
+    zip_fclose(zf);
+    return retval;
+}
+
+
+// Time unzipping a zip file with boinc_zip and with unzip_file
+void benchmarkUnzip(const std::string &zip_path, const std::string &benchmark_path, int nthreads) {
+    std::error_code ec;
+    double zip_size = (double) fs::file_size(zip_path,ec);
+
+    fs::remove_all(benchmark_path,ec);
+    fs::create_directories(benchmark_path,ec);
+    auto boinc_zip_start = steady_clock::now();
+    int boinc_zip_retval = boinc_zip(UNZIP_IT,zip_path,benchmark_path);
+    double boinc_zip_seconds = duration<double>(steady_clock::now() - boinc_zip_start).count();
+
+    fs::remove_all(benchmark_path,ec);
+    fs::create_directories(benchmark_path,ec);
+    auto unzip_file_start = steady_clock::now();
+    int unzip_file_retval = unzip_file(zip_path.c_str(),benchmark_path.c_str(),nthreads);
+    double unzip_file_seconds = duration<double>(steady_clock::now() - unzip_file_start).count();
+    fs::remove_all(benchmark_path,ec);
+
+    fprintf(stderr,"Benchmark of %s (%.0f bytes zipped):\n",zip_path.c_str(),zip_size);
+    fprintf(stderr,"  boinc_zip:  %.2f seconds (retval %i)\n",boinc_zip_seconds,boinc_zip_retval);
+    fprintf(stderr,"  unzip_file: %.2f seconds with %i threads (retval %i)\n",unzip_file_seconds,nthreads,unzip_file_retval);
+    fflush(stderr);
+}
+
+// Unzip a zip file into the destination folder
+int unzipFile(const std::string &zip_path, const std::string &dest_dir, int nthreads, const ENTRY_FILTER &filter) {
+    return unzip_file(zip_path.c_str(),dest_dir.c_str(),nthreads,filter);
+}
+
+// Run a staging step on its own thread, recording how long it took
+void runStagingStep(STAGING_STEP *step) {
+    auto step_start = steady_clock::now();
+    if (step->cache_path.empty())
+       step->retval = unzipFile(step->zip_path,step->dest_dir,step->nthreads,step->filter);
+    else if (!step->install_prefix.empty())
+       step->retval = installApp(step);
+    else
+       step->retval = unzipCached(step->zip_path,step->cache_path,step->dest_dir,step->nthreads,step->filter);
+    step->seconds = duration<double>(steady_clock::now() - step_start).count();
+}
+
+// Extract a zip file into an entry of the cache in the project directory keyed by the checksum of the zip. On success
+// the entry is returned with a shared lock held on it, which stops it being pruned until the lock is released.
+int cacheZip(const std::string &zip_path, const std::string &cache_path, const std::string &prefix, int nthreads,
+             std::string &entry, int &lock_fd) {
+    char md5_cksum[MD5_LEN];
+    double nbytes;
+    int retval = 0;
+    struct stat item_stat;
+    std::error_code ec;
+
+    lock_fd = -1;
+
+    // Key the cache entry on the checksum of the zip file
+    memset(md5_cksum,0x00,sizeof(md5_cksum));
+    if (zipChecksum(zip_path,cache_path,md5_cksum,nbytes)) return 1;
+    entry = cache_path + std::string("/") + prefix + md5_cksum;
+    std::string lock_file = entry + std::string(".lock");
+
+    // Lock the cache entry so that only one task extracts it
+    int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd < 0 || flock(fd,LOCK_EX) != 0) {
+       fprintf(stderr,"..Locking the cache entry %s failed\n",entry.c_str());
+       if (fd >= 0) close(fd);
+       return 1;
+    }
+
+    if (!fs::exists(entry)) {
+       // Extract into a temporary folder which is renamed into place once complete
+       std::string entry_tmp = entry + std::string(".tmp");
+       fs::remove_all(entry_tmp,ec);
+       if (mkdir(entry_tmp.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0) {
+          fprintf(stderr,"..mkdir for the cache entry %s failed\n",entry_tmp.c_str());
+          retval = 1;
+       }
+       else {
+          fprintf(stderr,"Adding to the cache: %s (%.0f bytes)\n",entry.c_str(),nbytes);
+          fflush(stderr);
+          retval = unzipFile(zip_path,entry_tmp,nthreads);
+       }
+       if (!retval) {
+          // The cached files are made read-only as the slots hold hard links to them and run from them
+          for (auto &item : fs::recursive_directory_iterator(entry_tmp)) {
+             if (fs::is_regular_file(item.path()) && stat(item.path().c_str(),&item_stat) == 0)
+                chmod(item.path().c_str(),item_stat.st_mode & ~(S_IWUSR|S_IWGRP|S_IWOTH));
+          }
+          if (rename(entry_tmp.c_str(),entry.c_str()) != 0) {
+             fprintf(stderr,"..Renaming the cache entry %s failed\n",entry_tmp.c_str());
+             retval = 1;
+          }
+       }
+       if (retval) fs::remove_all(entry_tmp,ec);
+    }
+    else {
+       fprintf(stderr,"Found in the cache: %s\n",entry.c_str());
+    }
+
+    if (retval) {
+       flock(fd,LOCK_UN);
+       close(fd);
+       return retval;
+    }
+
+    // Mark the cache entry as recently used and let other tasks share it
+    utime(entry.c_str(),NULL);
+    flock(fd,LOCK_SH);
+    lock_fd = fd;
+    return 0;
+}
+
+// The checksum of a zip file. The checksums are recorded in a file in the cache with the size and modification time of
+// each zip, so a zip is only read through again when it has changed. A line is the checksum, the size, the
+// modification time and the path of the zip.
+int zipChecksum(const std::string &zip_path, const std::string &cache_path, char *md5_cksum, double &nbytes) {
+    std::string sums_path = cache_path + std::string("/openifs_checksums.txt");
+    std::string sums_tmp = sums_path + std::string(".tmp");
+    std::string lock_file = sums_path + std::string(".lock");
+    std::vector<std::string> lines;
+    std::string line, entry_cksum, entry_path;
+    struct stat zip_stat;
+    double entry_size;
+    long entry_mtime;
+
+    if (stat(zip_path.c_str(),&zip_stat) != 0) {
+       fprintf(stderr,"..Reading the size of %s failed\n",zip_path.c_str());
+       return 1;
+    }
+
+    // Other tasks may be writing the file
+    int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd >= 0) flock(fd,LOCK_SH);
+    std::ifstream sums_file(sums_path);
+    while (std::getline(sums_file,line)) {
+       std::istringstream fields(line);
+       if (!(fields >> entry_cksum >> entry_size >> entry_mtime) || !std::getline(fields >> std::ws,entry_path)) continue;
+       if (entry_path == zip_path && entry_size == (double) zip_stat.st_size && entry_mtime == (long) zip_stat.st_mtime &&
+           entry_cksum.size() < MD5_LEN) {
+          strncpy(md5_cksum,entry_cksum.c_str(),MD5_LEN-1);
+          nbytes = entry_size;
+          if (fd >= 0) {
+             flock(fd,LOCK_UN);
+             close(fd);
+          }
+          return 0;
+       }
+    }
+    sums_file.close();
+    if (fd >= 0) flock(fd,LOCK_UN);
+
+    if (md5_file(zip_path.c_str(),md5_cksum,nbytes)) {
+       fprintf(stderr,"..Calculating the checksum of %s failed\n",zip_path.c_str());
+       if (fd >= 0) close(fd);
+       return 1;
+    }
+
+    // Record the checksum, replacing the line of an earlier version of the zip and dropping zips no longer there
+    if (fd < 0 || flock(fd,LOCK_EX) != 0) {
+       fprintf(stderr,"..Locking the checksum file %s failed\n",sums_path.c_str());
+       if (fd >= 0) close(fd);
+       return 0;
+    }
+    sums_file.clear();
+    sums_file.open(sums_path);
+    while (std::getline(sums_file,line)) {
+       std::istringstream fields(line);
+       if (!(fields >> entry_cksum >> entry_size >> entry_mtime) || !std::getline(fields >> std::ws,entry_path)) continue;
+       if (entry_path == zip_path || !fs::exists(entry_path)) continue;
+       lines.push_back(line);
+    }
+    sums_file.close();
+
+    std::ostringstream entry;
+    entry << md5_cksum << " " << (long long) zip_stat.st_size << " " << (long) zip_stat.st_mtime << " " << zip_path;
+    lines.push_back(entry.str());
+
+    std::ofstream sums_out(sums_tmp);
+    for (auto &entry_line : lines) sums_out << entry_line << "\n";
+    sums_out.close();
+    if (sums_out.fail() || rename(sums_tmp.c_str(),sums_path.c_str()) != 0)
+       fprintf(stderr,"..Writing the checksum file %s failed\n",sums_path.c_str());
+    flock(fd,LOCK_UN);
+    close(fd);
+    return 0;
+}
+
+// Unzip a zip file through the cache and link the extracted files into the destination folder. The whole zip is held
+// in the cache, the filter only applies to the files linked into the destination folder.
+int unzipCached(const std::string &zip_path, const std::string &cache_path, const std::string &dest_dir, int nthreads,
+                const ENTRY_FILTER &filter) {
+    std::string entry;
+    int lock_fd, retval;
+
+    retval = cacheZip(zip_path,cache_path,"",nthreads,entry,lock_fd);
+    if (!retval) {
+       retval = linkTree(entry,dest_dir,filter);
+       flock(lock_fd,LOCK_UN);
+       close(lock_fd);
+    }
+
+    if (retval) {
+       fprintf(stderr,"..Staging %s from the cache failed, unzipping without the cache\n",zip_path.c_str());
+       retval = unzipFile(zip_path,dest_dir,nthreads,filter);
+    }
+    return retval;
+}
+
+// Install the app zip as a read-only tree in the cache, shared by every task of this app version, and link its top
+// level files and folders into the working directory. The model runs from the shared tree for the lifetime of the
+// task, so the lock on the cache entry is kept.
+int installApp(STAGING_STEP *step) {
+    int retval;
+    std::error_code ec;
+
+    retval = cacheZip(step->zip_path,step->cache_path,step->install_prefix,step->nthreads,step->install_path,step->lock_fd);
+    if (!retval) {
+       for (auto &item : fs::directory_iterator(step->install_path)) {
+          std::string dest = step->dest_dir + std::string("/") + item.path().filename().string();
+          fs::remove(dest,ec);
+          if (symlink(item.path().c_str(),dest.c_str()) != 0) {
+             fprintf(stderr,"..Linking %s into the working directory failed\n",item.path().c_str());
+             retval = 1;
+          }
+       }
+    }
+
+    if (retval) {
+       fprintf(stderr,"..Installing %s into the cache failed, unzipping into the working directory\n",step->zip_path.c_str());
+       step->install_path = step->dest_dir;
+       retval = unzipFile(step->zip_path,step->dest_dir,step->nthreads);
+    }
+    return retval;
+}
+
+// Recreate the folder structure of the source folder in the destination folder and link in each file
+int linkTree(const std::string &src_dir, const std::string &dest_dir, const ENTRY_FILTER &filter) {
+    int retval = 0;
+
+    for (auto &item : fs::recursive_directory_iterator(src_dir)) {
+       std::string dest = dest_dir + item.path().string().substr(src_dir.length());
+       if (fs::is_directory(item.path())) {
+          if (mkdir(dest.c_str(),S_IRWXU|S_IRWXG|S_IROTH|S_IXOTH) != 0 && errno != EEXIST) {
+             fprintf(stderr,"..mkdir for the folder %s failed\n",dest.c_str());
+             retval = 1;
+          }
+       }
+       else if (filter && !filter(item.path().string().substr(src_dir.length()+1))) {
+          continue;
+       }
+       else if (linkFile(item.path().string(),dest)) {
+          retval = 1;
+       }
+    }
+    return retval;
+}
+
+// Link a file into place, falling back to a reflink and then to a copy when the files are on different filesystems
+int linkFile(const std::string &src, const std::string &dest) {
+    int retval;
+    std::error_code ec;
+
+    fs::remove(dest,ec);
+    if (link(src.c_str(),dest.c_str()) == 0) return 0;
+
+    #ifndef __APPLE__ // Linux
+       int src_fd = open(src.c_str(),O_RDONLY);
+       int dest_fd = open(dest.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+       if (src_fd >= 0 && dest_fd >= 0) {
+          retval = ioctl(dest_fd,FICLONE,src_fd);
+          close(src_fd);
+          close(dest_fd);
+          if (retval == 0) return 0;
+       }
+       else {
+          if (src_fd >= 0) close(src_fd);
+          if (dest_fd >= 0) close(dest_fd);
+       }
+    #endif
+
+    retval = boinc_copy(src.c_str(),dest.c_str());
+    if (retval) fprintf(stderr,"..Linking %s to %s failed\n",src.c_str(),dest.c_str());
+    return retval;
+}
+
+// Choose the OpenMP settings of a task from the step rates cached for its key. A task times the first candidate that
+// is neither timed nor taken by another task in the last two days, and takes it in the file under the lock so that
+// concurrent tasks time different candidates. Returns true if the chosen settings are to be timed, or false if the
+// fastest timed settings are chosen, or the first candidate while the others are being timed.
+bool chooseTuning(const std::string &tuning_path, const std::string &key, int ncpus, OMP_TUNING &tuning) {
+    std::vector<OMP_TUNING> candidates = tuningCandidates(ncpus);
+    bool trial = false;
+
+    std::string lock_file = tuning_path + std::string(".lock");
+    int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd < 0 || flock(fd,LOCK_EX) != 0) {
+       fprintf(stderr,"..Locking the autotune file %s failed\n",tuning_path.c_str());
+       if (fd >= 0) close(fd);
+       tuning = candidates[0];
+       return false;
+    }
+
+    readTuning(tuning_path,key,candidates);
+    long now = (long) time(NULL);
+    for (auto &candidate : candidates) {
+       if (candidate.steps_per_second <= 0 && now - candidate.taken > 2*86400) {
+          tuning = candidate;
+          tuning.taken = now;
+          trial = (writeTuning(tuning_path,key,tuning) == 0);
+          break;
+       }
+    }
+    flock(fd,LOCK_UN);
+    close(fd);
+    if (trial) return true;
+
+    tuning = candidates[0];
+    for (auto &candidate : candidates) {
+       if (candidate.steps_per_second > tuning.steps_per_second) tuning = candidate;
+    }
+    return false;
+}
+
+// The fastest of the timed OpenMP settings for a key, returns false if none has been timed
+bool fastestTuning(const std::string &tuning_path, const std::string &key, int ncpus, OMP_TUNING &tuning) {
+    std::vector<OMP_TUNING> candidates = tuningCandidates(ncpus);
+
+    // Other tasks may be writing the file
+    std::string lock_file = tuning_path + std::string(".lock");
+    int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd >= 0) flock(fd,LOCK_SH);
+    readTuning(tuning_path,key,candidates);
+    if (fd >= 0) {
+       flock(fd,LOCK_UN);
+       close(fd);
+    }
+
+    bool timed = false;
+    for (auto &candidate : candidates) {
+       if (candidate.steps_per_second > 0 && (!timed || candidate.steps_per_second > tuning.steps_per_second)) {
+          tuning = candidate;
+          timed = true;
+       }
+    }
+    return timed;
+}
+
+// Record the step rate of a task's OpenMP settings in the cache file, replacing an earlier rate of the same settings.
+// Settings that are neither timed nor taken release the candidate for another task.
+int recordTuning(const std::string &tuning_path, const std::string &key, const OMP_TUNING &tuning) {
+    std::string lock_file = tuning_path + std::string(".lock");
+    int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+    if (fd < 0 || flock(fd,LOCK_EX) != 0) {
+       fprintf(stderr,"..Locking the autotune file %s failed\n",tuning_path.c_str());
+       if (fd >= 0) close(fd);
+       return 1;
+    }
+    int retval = writeTuning(tuning_path,key,tuning);
+    flock(fd,LOCK_UN);
+    close(fd);
+    return retval;
+}
+
+// The candidate OpenMP settings, the threads BOINC assigned and half of them, each with a static and a guided schedule
+std::vector<OMP_TUNING> tuningCandidates(int ncpus) {
+    std::vector<OMP_TUNING> candidates;
+    for (int nthreads : {ncpus, ncpus/2}) {
+       if (nthreads < 1 || (!candidates.empty() && nthreads == candidates[0].nthreads)) continue;
+       for (const char *schedule : {"STATIC","GUIDED"}) {
+          OMP_TUNING candidate;
+          candidate.nthreads = nthreads;
+          candidate.schedule = schedule;
+          candidates.push_back(candidate);
+       }
+    }
+    return candidates;
+}
+
+// Read the step rates and the takes of the candidates from the cache file, the caller holds the lock. A line is the
+// key, the threads, the schedule, the stack size, the step rate and the time the settings were taken.
+void readTuning(const std::string &tuning_path, const std::string &key, std::vector<OMP_TUNING> &candidates) {
+    std::ifstream tuning_file(tuning_path);
+    std::string line;
+    while (std::getline(tuning_file,line)) {
+       std::istringstream fields(line);
+       std::string entry_key;
+       OMP_TUNING entry;
+       if (!(fields >> entry_key >> entry.nthreads >> entry.schedule >> entry.stacksize >> entry.steps_per_second)) continue;
+       if (!(fields >> entry.taken)) entry.taken = 0;
+       for (auto &candidate : candidates) {
+          if (entry_key == key && entry.nthreads == candidate.nthreads && entry.schedule == candidate.schedule &&
+              entry.stacksize == candidate.stacksize) {
+             candidate.steps_per_second = entry.steps_per_second;
+             candidate.taken = entry.taken;
+          }
+       }
+    }
+}
+
+// Replace the line of a key's OpenMP settings in the cache file, the caller holds the lock
+int writeTuning(const std::string &tuning_path, const std::string &key, const OMP_TUNING &tuning) {
+    std::string tuning_tmp = tuning_path + std::string(".tmp");
+    std::vector<std::string> lines;
+    std::string line;
+
+    std::ifstream tuning_file(tuning_path);
+    while (std::getline(tuning_file,line)) {
+       std::istringstream fields(line);
+       std::string entry_key;
+       OMP_TUNING entry;
+       if (!(fields >> entry_key >> entry.nthreads >> entry.schedule >> entry.stacksize)) continue;
+       if (entry_key == key && entry.nthreads == tuning.nthreads && entry.schedule == tuning.schedule &&
+           entry.stacksize == tuning.stacksize) continue;
+       lines.push_back(line);
+    }
+    tuning_file.close();
+
+    if (tuning.steps_per_second > 0 || tuning.taken > 0) {
+       std::ostringstream entry;
+       entry << key << " " << tuning.nthreads << " " << tuning.schedule << " " << tuning.stacksize << " "
+             << tuning.steps_per_second << " " << tuning.taken;
+       lines.push_back(entry.str());
+    }
+
+    std::ofstream tuning_out(tuning_tmp);
+    for (auto &entry_line : lines) tuning_out << entry_line << "\n";
+    tuning_out.close();
+    if (tuning_out.fail() || rename(tuning_tmp.c_str(),tuning_path.c_str()) != 0) {
+       fprintf(stderr,"..Writing the autotune file %s failed\n",tuning_path.c_str());
+       return 1;
+    }
+    return 0;
+}
+
+// Remove the cache entries that have not been used for the given number of days
+void pruneCache(const std::string &cache_path, int max_age_days) {
+    struct stat entry_stat;
+    std::error_code ec;
+    time_t cutoff = time(NULL) - (time_t) max_age_days * 86400;
+
+    for (auto &item : fs::directory_iterator(cache_path,ec)) {
+       std::string entry = item.path().string();
+       if (!fs::is_directory(item.path()) || entry.size() < 4 || entry.compare(entry.size()-4,4,".tmp") == 0) continue;
+       if (stat(entry.c_str(),&entry_stat) != 0 || entry_stat.st_mtime > cutoff) continue;
+
+       // Only remove the entry if no other task holds its lock
+       std::string lock_file = entry + std::string(".lock");
+       int fd = open(lock_file.c_str(),O_RDWR|O_CREAT,0644);
+       if (fd < 0) continue;
+       if (flock(fd,LOCK_EX|LOCK_NB) == 0) {
+          fprintf(stderr,"Removing unused cache entry: %s\n",entry.c_str());
+          fs::remove_all(entry,ec);
+          flock(fd,LOCK_UN);
+       }
+       close(fd);
+    }
+}
+
+
+// Work out which files of the IFSDATA zip a run will read and record the selection in a manifest. The SO4 aerosol
+// files are held per decade, so only the decades covering the run (with a decade either side for the interpolation
+// between decades) are needed. An empty set is returned if every file is to be staged.
+std::set<std::string> selectIfsdataMembers(const std::string &zip_path, const std::string &start_date,
+                                           const std::string &fclen, const std::string &manifest_path) {
+    std::set<std::string> members;
+    std::vector<std::string> names;
+    struct zip *opened_file;
+    struct zip_stat zip_position;
+    struct tm run_date;
+    int err,i,first_year,last_year,decade;
+    bool so4_selected = false;
+
+    if (start_date.length() < 8 || atoi(fclen.c_str()) <= 0) return members;
+
+    // Find the first and last years of the run
+    memset(&run_date,0x00,sizeof(run_date));
+    run_date.tm_year = atoi(start_date.substr(0,4).c_str()) - 1900;
+    run_date.tm_mon = atoi(start_date.substr(4,2).c_str()) - 1;
+    run_date.tm_mday = atoi(start_date.substr(6,2).c_str());
+    first_year = run_date.tm_year + 1900;
+    run_date.tm_mday += atoi(fclen.c_str());
+    timegm(&run_date);
+    last_year = run_date.tm_year + 1900;
+
+    if ((opened_file = zip_open(zip_path.c_str(), 0, &err)) == NULL) return members;
+    for (i = 0; i < zip_get_num_entries(opened_file,0); i++) {
+       if (zip_stat_index(opened_file,i,0,&zip_position) == 0) names.push_back(zip_position.name);
+    }
+    zip_discard(opened_file);
+
+    for (auto &name : names) {
+       if (name.compare(0,4,"SO4_") == 0 && name.length() >= 4) {
+          decade = atoi(name.substr(name.length()-4).c_str());
+          if (decade < (first_year/10)*10 - 10 || decade > (last_year/10)*10 + 10) continue;
+          so4_selected = true;
+       }
+       members.insert(name);
+    }
+
+    // If no SO4 file covers the run then stage all of them
+    if (!so4_selected) {
+       for (auto &name : names) members.insert(name);
+    }
+
+    // Record which files were extracted and which were skipped
+    FILE* manifest = boinc_fopen(manifest_path.c_str(),"w");
+    if (manifest) {
+       fprintf(manifest,"# IFSDATA files for the years %i to %i\n",first_year,last_year);
+       for (auto &name : names) fprintf(manifest,"%s %s\n",members.count(name) ? "extracted" : "skipped",name.c_str());
+       fclose(manifest);
+    }
+    fprintf(stderr,"Staging %lu of the %lu IFSDATA files for the years %i to %i\n",members.size(),names.size(),first_year,last_year);
+
+    return members;
+}
+
+
+// Read a Fortran namelist file. The variables of each '&GROUP ... /' are stored as their raw value text, and the
+// '!KEY=value' comments used by the workunit generator are stored as tags.
+int parseNamelist(const std::string &namelist_path, OIFS_CONFIG &config) {
+    std::ifstream namelist(namelist_path);
+    std::string line, group, body;
+
+    if (!namelist.is_open()) return 1;
+
+    while (std::getline(namelist, line)) {
+       // Split off any comment, a '!' within a quoted string does not start a comment
+       char quote = 0;
+       std::string text, comment;
+       for (size_t ii = 0; ii < line.length(); ii++) {
+          char c = line[ii];
+          if (quote) {
+             if (c == quote) quote = 0;
+          }
+          else if (c == '\'' || c == '"') {
+             quote = c;
+          }
+          else if (c == '!') {
+             comment = line.substr(ii+1);
+             break;
+          }
+          text += c;
+       }
+
+       // Store the '!KEY=value' tags, the first occurrence of a tag is kept
+       size_t equals = comment.find('=');
+       if (equals != std::string::npos && equals > 0 && comment[0] != ' ') {
+          std::string key = comment.substr(0,equals), value = comment.substr(equals+1);
+          while (!value.empty() && std::isspace(*value.rbegin())) value.erase(value.length()-1);
+          while (!value.empty() && std::isspace(*value.begin())) value.erase(0,1);
+          if (key.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") == std::string::npos && !config.tags.count(key))
+             config.tags[key] = value;
+       }
+
+       // Collect the text of each namelist group
+       for (size_t ii = 0; ii < text.length(); ii++) {
+          char c = text[ii];
+          if (group.empty()) {
+             if (c == '&') {
+                size_t end = text.find_first_of(" \t,",ii);
+                if (end == std::string::npos) end = text.length();
+                group = text.substr(ii+1,end-ii-1);
+                std::transform(group.begin(),group.end(),group.begin(),::toupper);
+                body.clear();
+                ii = end;
+             }
+             continue;
+          }
+          if (c == '\'' || c == '"') {
+             size_t end = text.find(c,ii+1);
+             if (end == std::string::npos) end = text.length()-1;
+             body += text.substr(ii,end-ii+1);
+             ii = end;
+          }
+          else if (c == '/' || (c == '&' && text.compare(ii,4,"&END") == 0)) {
+             parseNamelistGroup(group,body,config);
+             group.clear();
+             if (c == '&') ii += 3;
+          }
+          else {
+             body += c;
+          }
+       }
+       if (!group.empty()) body += ' ';
+    }
+    if (!group.empty()) parseNamelistGroup(group,body,config);
+
+    // Fill in the typed values
+    config.ifsdata_file = config.tags["IFSDATA_FILE"];
+    config.ic_ancil_file = config.tags["IC_ANCIL_FILE"];
+    config.climate_data_file = config.tags["CLIMATE_DATA_FILE"];
+    config.grid_type = config.tags["GRID_TYPE"];
+    config.horiz_resolution = atoi(config.tags["HORIZ_RESOLUTION"].c_str());
+    config.vert_resolution = atoi(config.tags["VERT_RESOLUTION"].c_str());
+    config.upload_interval = atoi(config.tags["UPLOAD_INTERVAL"].c_str());
+    config.timestep = (int) atof(config.value("TSTEP").c_str());
+    config.output_frequency = atoi(config.value("NFRPOS").c_str());
+    config.nstop = atoi(config.value("NSTOP").c_str());
+    config.zip_threads = atoi(config.tags["ZIP_THREADS"].c_str());
+    config.upload_codec = config.tags["UPLOAD_CODEC"];
+    config.upload_keep = config.tags["UPLOAD_KEEP"];
+    config.upload_delta = (atoi(config.tags["UPLOAD_DELTA"].c_str()) != 0);
+    config.diag_params = config.tags["DIAG_PARAMS"];
+    config.autotune = (atoi(config.tags["AUTOTUNE"].c_str()) != 0);
+    config.launch_profile = config.tags["LAUNCH_PROFILE"];
+    if (config.tags.count("SUSPEND_GRACE")) config.suspend_grace = atoi(config.tags["SUSPEND_GRACE"].c_str());
+    if (config.tags.count("SAMPLE_INTERVAL")) config.sample_interval = atoi(config.tags["SAMPLE_INTERVAL"].c_str());
+
+    return 0;
+}
+
+// Split the text of a namelist group into its variables, a variable takes every value up to the next 'NAME='
+void parseNamelistGroup(const std::string &group, const std::string &body, OIFS_CONFIG &config) {
+    std::vector<std::string> tokens;
+    std::string token, name;
+    size_t ii;
+
+    // Tokenise into quoted strings, '=' and the words separated by commas or white space
+    for (ii = 0; ii < body.length(); ii++) {
+       char c = body[ii];
+       if (c == '\'' || c == '"') {
+          size_t end = body.find(c,ii+1);
+          if (end == std::string::npos) end = body.length();
+          token += body.substr(ii+1,end-ii-1);
+          ii = end;
+       }
+       else if (c == '=' || c == ',' || std::isspace(c)) {
+          if (!token.empty()) tokens.push_back(token);
+          token.clear();
+          if (c == '=') tokens.push_back("=");
+       }
+       else {
+          token += c;
+       }
+    }
+    if (!token.empty()) tokens.push_back(token);
+
+    for (ii = 0; ii < tokens.size(); ii++) {
+       if (ii+1 < tokens.size() && tokens[ii+1] == "=") {
+          name = tokens[ii];
+          std::transform(name.begin(),name.end(),name.begin(),::toupper);
+          config.groups[group][name] = "";
+          ii++;
+       }
+       else if (!name.empty()) {
+          std::string &value = config.groups[group][name];
+          if (!value.empty()) value += ",";
+          value += tokens[ii];
+       }
+    }
+}
+
+// Return the value of a namelist variable from whichever group it is in, or an empty string
+std::string OIFS_CONFIG::value(const std::string &name) const {
+    for (auto &group : groups) {
+       auto variable = group.second.find(name);
+       if (variable != group.second.end()) return variable->second;
+    }
+    return "";
+}
+
+// Work out the output and upload steps of the run from the namelist. The run is NSTOP steps long, or fclen days if
+// NSTOP is not given. An upload ends every upload_interval steps, with the last upload made when the model finishes.
+void buildSchedule(const OIFS_CONFIG &config, int fclen_days, OUTPUT_SCHEDULE &schedule) {
+    int step, output_frequency;
+
+    schedule.output_steps.clear();
+    schedule.upload_steps.clear();
+    schedule.nstop = config.nstop;
+    if (schedule.nstop <= 0 && config.timestep > 0) schedule.nstop = (fclen_days * 86400) / config.timestep;
+
+    // A negative NFRPOS is a frequency in hours
+    output_frequency = config.output_frequency;
+    if (output_frequency < 0 && config.timestep > 0) output_frequency = (-output_frequency * 3600) / config.timestep;
+
+    if (output_frequency > 0) {
+       for (step = 0; step <= schedule.nstop; step += output_frequency) schedule.output_steps.push_back(step);
+    }
+    // Without an output frequency every step is checked for output files
+    else {
+       for (step = 0; step <= schedule.nstop; step++) schedule.output_steps.push_back(step);
+    }
+
+    if (config.upload_interval > 0) {
+       for (step = config.upload_interval; step < schedule.nstop; step += config.upload_interval)
+          schedule.upload_steps.push_back(step);
+    }
+}
+
+// Return the path of the ICMGG/ICMSH output file written at a step, the step is zero padded to six digits
+std::string icmFileName(const std::string &slot_path, const char *file_type, const std::string &exptid, int step) {
+    char step_str[16];
+    snprintf(step_str,sizeof(step_str),"%06d",step);
+    return slot_path + std::string("/") + file_type + exptid + std::string("+") + step_str;
+}
+
+
+// Update the progress with the step the model has reached, the wall and CPU time per step are smoothed with an
+// exponential moving average. The estimate of the time remaining is logged at every 5% of the run.
+void updateProgress(PROGRESS &progress, int step, long handleProcess) {
+    const double alpha = 0.1;
+    if (step <= progress.last_step) return;
+
+    auto now = steady_clock::now();
+    double cpu_seconds = childCpuSeconds(handleProcess);
+    if (!progress.rebase && progress.last_step >= 0) {
+       int nsteps = step - progress.last_step;
+       double wall = duration<double>(now - progress.last_step_time).count() / nsteps;
+       double cpu = std::max(cpu_seconds - progress.cpu_seconds,0.0) / nsteps;
+       progress.measured_steps += nsteps;
+       progress.measured_seconds += wall * nsteps;
+       progress.step_seconds = (progress.step_seconds > 0) ? alpha * wall + (1 - alpha) * progress.step_seconds : wall;
+       progress.step_cpu_seconds = (progress.step_cpu_seconds > 0) ? alpha * cpu + (1 - alpha) * progress.step_cpu_seconds : cpu;
+    }
+    progress.rebase = false;
+    progress.last_step = step;
+    progress.last_step_time = now;
+    progress.cpu_seconds = cpu_seconds;
+
+    if (progress.nstop > 0 && progress.step_seconds > 0 && 100 * step >= progress.next_log_percent * progress.nstop) {
+       fprintf(stderr,"Step %i of %i, %.2f seconds and %.2f CPU seconds per step, %.4f steps per second on %i threads, "
+                      "%.2f hours remaining\n",step,progress.nstop,progress.step_seconds,progress.step_cpu_seconds,
+               1 / progress.step_seconds,progress.nthreads,(progress.nstop - step) * progress.step_seconds / 3600);
+       fflush(stderr);
+       while (100 * step >= progress.next_log_percent * progress.nstop) progress.next_log_percent += 5;
+    }
+}
+
+// Report the fraction of the run done and the CPU time of the model to the BOINC client
+void reportProgress(PROGRESS &progress, long handleProcess) {
+    double fraction_done = 0;
+    if (progress.nstop > 0 && progress.last_step > 0) fraction_done = std::min(1.0,(double) progress.last_step / progress.nstop);
+    boinc_fraction_done(fraction_done);
+    boinc_report_app_status(childCpuSeconds(handleProcess),progress.checkpoint_cpu_seconds,fraction_done);
+}
+
+// The CPU time of the model, the processes that have ended are counted by RUSAGE_CHILDREN and the running
+// process is read from /proc, or from proc_pidinfo on macOS
+double childCpuSeconds(long handleProcess) {
+    struct rusage usage;
+    double cpu_seconds = 0;
+
+    if (getrusage(RUSAGE_CHILDREN,&usage) == 0) {
+       cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1.0e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1.0e6;
+    }
+    if (handleProcess <= 0) return cpu_seconds;
+
+    #ifndef __APPLE__ // Linux
+       // The user and system times of the process and its ended children are the 14th to 17th fields
+       std::ifstream stat_file(std::string("/proc/") + std::to_string(handleProcess) + std::string("/stat"));
+       std::string line;
+       if (std::getline(stat_file,line) && line.rfind(')') != std::string::npos) {
+          std::istringstream fields(line.substr(line.rfind(')')+1));
+          std::string field;
+          double ticks = 0;
+          for (int ii = 3; ii <= 17 && (fields >> field); ii++) {
+             if (ii >= 14) ticks += atof(field.c_str());
+          }
+          cpu_seconds += ticks / sysconf(_SC_CLK_TCK);
+       }
+    #else // macOS
+       struct proc_taskinfo task_info;
+       if (proc_pidinfo((int) handleProcess,PROC_PIDTASKINFO,0,&task_info,sizeof(task_info)) == (int) sizeof(task_info)) {
+          cpu_seconds += (task_info.pti_total_user + task_info.pti_total_system) / 1.0e9;
+       }
+    #endif
+    return cpu_seconds;
+}
+
+// Skip the lines already in ifs.stat, for a model that is restarting from a restart dump
+void skipIfsStat(IFS_STAT_TAIL &tail) {
+    struct stat stat_buf;
+    tail.offset = (stat(tail.path.c_str(),&stat_buf) == 0) ? stat_buf.st_size : 0;
+    tail.partial.clear();
+    tail.last_step = -1;
+}
+
+// Read the lines appended to ifs.stat since the last read and record the step of the last complete line. The step
+// is the fourth column of each line. Returns the number of new lines read.
+int readIfsStat(IFS_STAT_TAIL &tail) {
+    char buf[65536];
+    struct stat stat_buf;
+    ssize_t nread;
+    size_t start, end;
+    int step, nlines = 0;
+
+    if (tail.fd < 0) {
+       tail.fd = open(tail.path.c_str(),O_RDONLY);
+       if (tail.fd < 0) return 0;
+    }
+
+    // Start again from the beginning if the file has been truncated
+    if (fstat(tail.fd,&stat_buf) == 0 && stat_buf.st_size < tail.offset) {
+       tail.offset = 0;
+       tail.partial.clear();
+    }
+
+    while ((nread = pread(tail.fd,buf,sizeof(buf),tail.offset)) > 0) {
+       tail.offset += nread;
+       tail.partial.append(buf,nread);
+
+       // Parse each complete line on its own, so that a short line does not take its step from the next
+       for (start = 0; (end = tail.partial.find('\n',start)) != std::string::npos; start = end + 1) {
+          std::string line = tail.partial.substr(start,end - start);
+          if (sscanf(line.c_str(),"%*s %*s %*s %d",&step) == 1) tail.last_step = step;
+          nlines++;
+       }
+       tail.partial.erase(0,start);
+    }
+    return nlines;
+}
+
+// Set up the monitor loop's events: an inotify watch on the working directory for ifs.stat and the output files, a
+// signalfd for SIGCHLD and a one second timer, all waited on through epoll. If these are not available the monitor
+// loop falls back to polling once a second.
+void openMonitorEvents(MONITOR_EVENTS &monitor, const char *slot_path) {
+    #ifndef __APPLE__ // Linux
+       struct epoll_event event;
+       struct itimerspec interval;
+       sigset_t child_mask;
+
+       monitor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+       if (monitor.epoll_fd < 0) {
+          fprintf(stderr,"..Creating the epoll instance failed, polling instead\n");
+          return;
+       }
+
+       monitor.timer_fd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+       if (monitor.timer_fd >= 0) {
+          interval.it_interval.tv_sec = interval.it_value.tv_sec = 1;
+          interval.it_interval.tv_nsec = interval.it_value.tv_nsec = 0;
+          timerfd_settime(monitor.timer_fd,0,&interval,NULL);
+          event.events = EPOLLIN;
+          event.data.fd = monitor.timer_fd;
+          epoll_ctl(monitor.epoll_fd,EPOLL_CTL_ADD,monitor.timer_fd,&event);
+       }
+
+       sigemptyset(&child_mask);
+       sigaddset(&child_mask,SIGCHLD);
+       monitor.signal_fd = signalfd(-1,&child_mask,SFD_NONBLOCK|SFD_CLOEXEC);
+       if (monitor.signal_fd >= 0) {
+          event.events = EPOLLIN;
+          event.data.fd = monitor.signal_fd;
+          epoll_ctl(monitor.epoll_fd,EPOLL_CTL_ADD,monitor.signal_fd,&event);
+       }
+
+       // The directory is watched for files being created and closed, and ifs.stat itself for each write to it.
+       // Watching the directory for writes would wake the loop for every write to the output files.
+       monitor.stat_path = slot_path + std::string("/ifs.stat");
+       monitor.inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+       if (monitor.inotify_fd >= 0 &&
+           inotify_add_watch(monitor.inotify_fd,slot_path,IN_CREATE|IN_CLOSE_WRITE|IN_MOVED_TO) >= 0) {
+          monitor.stat_wd = inotify_add_watch(monitor.inotify_fd,monitor.stat_path.c_str(),IN_MODIFY);
+          monitor.watching_outputs = true;
+          event.events = EPOLLIN;
+          event.data.fd = monitor.inotify_fd;
+          epoll_ctl(monitor.epoll_fd,EPOLL_CTL_ADD,monitor.inotify_fd,&event);
+       }
+       else {
+          fprintf(stderr,"..Watching the working directory failed, polling ifs.stat instead\n");
+          if (monitor.inotify_fd >= 0) close(monitor.inotify_fd);
+          monitor.inotify_fd = -1;
+       }
+    #endif
+}
+
+// Wait for the next events of the monitor loop, the names of any output files the model has closed are added to
+// the monitor's closed_outputs. Returns the events as a bitmask.
+int waitMonitorEvents(MONITOR_EVENTS &monitor) {
+    int result = 0;
+
+    #ifndef __APPLE__ // Linux
+       struct epoll_event events[8];
+       char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+       struct signalfd_siginfo siginfo;
+       uint64_t expirations;
+       ssize_t nread;
+       int nevents, ii;
+
+       if (monitor.epoll_fd >= 0) {
+          // The timeout is a safeguard in case the timer could not be created
+          nevents = epoll_wait(monitor.epoll_fd,events,8,1000);
+          if (nevents <= 0) result = EVENT_TIMER;
+
+          for (ii = 0; ii < nevents; ii++) {
+             if (events[ii].data.fd == monitor.timer_fd) {
+                while (read(monitor.timer_fd,&expirations,sizeof(expirations)) > 0);
+                result |= EVENT_TIMER;
+             }
+             else if (events[ii].data.fd == monitor.signal_fd) {
+                while (read(monitor.signal_fd,&siginfo,sizeof(siginfo)) > 0);
+                result |= EVENT_CHILD;
+             }
+             else if (events[ii].data.fd == monitor.inotify_fd) {
+                while ((nread = read(monitor.inotify_fd,buf,sizeof(buf))) > 0) {
+                   for (char *ptr = buf; ptr < buf + nread; ) {
+                      struct inotify_event *notify = (struct inotify_event *) ptr;
+                      if (notify->mask & IN_Q_OVERFLOW) {
+                         // Output files may have been closed unseen, from now on the output follows ifs.stat
+                         if (monitor.watching_outputs)
+                            fprintf(stderr,"..The inotify queue overflowed, following the output through ifs.stat\n");
+                         monitor.watching_outputs = false;
+                         result |= EVENT_STAT;
+                      }
+                      else if (notify->wd == monitor.stat_wd) {
+                         result |= EVENT_STAT;
+                      }
+                      else if (notify->len > 0 && strcmp(notify->name,"ifs.stat") == 0) {
+                         // Watch ifs.stat for writes once it has been created
+                         if (notify->mask & (IN_CREATE|IN_MOVED_TO))
+                            monitor.stat_wd = inotify_add_watch(monitor.inotify_fd,monitor.stat_path.c_str(),IN_MODIFY);
+                         result |= EVENT_STAT;
+                      }
+                      else if (notify->len > 0 && (notify->mask & IN_CLOSE_WRITE) && strncmp(notify->name,"ICM",3) == 0) {
+                         monitor.closed_outputs.insert(notify->name);
+                         result |= EVENT_OUTPUT;
+                      }
+                      ptr += sizeof(struct inotify_event) + notify->len;
+                   }
+                }
+             }
+          }
+
+          // Without the inotify watch ifs.stat is read on every timer tick
+          if (monitor.inotify_fd < 0 && (result & EVENT_TIMER)) result |= EVENT_STAT;
+          return result;
+       }
+    #endif
+
+    // Poll once a second
+    sleep_until(system_clock::now() + seconds(1));
+    result = EVENT_TIMER | EVENT_STAT;
+    return result;
+}
+
+// Close the file descriptors of the monitor loop's events
+void closeMonitorEvents(MONITOR_EVENTS &monitor) {
+    if (monitor.inotify_fd >= 0) close(monitor.inotify_fd);
+    if (monitor.signal_fd >= 0) close(monitor.signal_fd);
+    if (monitor.timer_fd >= 0) close(monitor.timer_fd);
+    if (monitor.epoll_fd >= 0) close(monitor.epoll_fd);
+    monitor.inotify_fd = monitor.signal_fd = monitor.timer_fd = monitor.epoll_fd = -1;
+}
+
+
+// Append the files of an upload job to the zip of its upload file and finish the zip if asked. Files already in the
+// zip are skipped. The ICM files are reduced to the kept GRIB fields, each gets a GRIB index sidecar and the ICMGG
+// files after the first in the zip are repacked as deltas against the previous step. The zip is built under a
+// '.part' name and renamed into place once it is finished, flushed to disk, so a zip under the upload name is
+// always complete.
+int packageUpload(UPLOAD_PACKAGER &packager, UPLOAD_JOB &job) {
+    std::string upload_part = job.upload_file + std::string(".part");
+    ZipFileList files, zip_files, sidecars;
+    std::error_code ec;
+    int retval, fd;
+
+    // Start the zip of this upload file, resuming one left by an earlier run
+    if (packager.archive_number != job.upload_file_number) {
+       dropDeltaReference(packager);
+       packager.summary.clear();
+       if (openArchive(packager.archive,upload_part,true)) return 1;
+       packager.archive_number = job.upload_file_number;
+    }
+    ZIP_ARCHIVE &archive = packager.archive;
+
+    // The files not yet in the zip, in name order so the ICMGG files are in step order. Files already in the zip
+    // from an earlier run are removed.
+    for (auto &file : job.files) {
+       std::string file_name = stripPath(file.c_str());
+       if (archiveHasEntry(archive,file_name) || archiveHasEntry(archive,file_name + std::string(".odl"))) {
+          if (job.remove_files && file != packager.delta_reference) fs::remove(file,ec);
+          continue;
+       }
+       if (fs::exists(file,ec)) files.push_back(file);
+    }
+    std::sort(files.begin(),files.end());
+
+    for (auto &file : files) {
+       std::string file_name = stripPath(file.c_str());
+       bool grib_file = (file_name.compare(0,3,"ICM") == 0 && fs::path(file_name).extension() != ".idx");
+       bool icmgg_file = grib_file && (file_name.compare(0,5,"ICMGG") == 0);
+       std::string zip_file = file;
+
+       // Summarise the ICMGG file before its fields are filtered
+       if (icmgg_file && job.diagnostics) packager.summary += takeDiagnostics(*job.diagnostics,file);
+
+       // Filter and index the ICM file, a file that cannot be scanned is zipped whole
+       if (grib_file) {
+          std::string index_file = file + std::string(".idx");
+          if (filterGribFile(file,job.keep,index_file)) {
+             fprintf(stderr,"..Indexing the GRIB file %s failed, zipping it whole\n",file.c_str());
+             fs::remove(index_file,ec);
+          }
+          else {
+             zip_files.push_back(index_file);
+             sidecars.push_back(index_file);
+          }
+       }
+
+       // Repack the ICMGG file as deltas against the previous step, the first in the zip is zipped whole so that each
+       // zip can be decoded on its own
+       if (icmgg_file && job.delta && !packager.delta_reference.empty()) {
+          std::string delta_file = file + std::string(".odl");
+          if (deltaEncodeGribFile(packager.delta_reference,file,delta_file)) {
+             fprintf(stderr,"..Repacking %s as deltas failed, zipping it whole\n",file.c_str());
+             fs::remove(delta_file,ec);
+          }
+          else {
+             sidecars.push_back(delta_file);
+             zip_file = delta_file;
+          }
+       }
+       if (icmgg_file && job.delta) {
+          dropDeltaReference(packager);
+          packager.delta_reference = file;
+          packager.remove_delta_reference = job.remove_files;
+       }
+       zip_files.push_back(zip_file);
+    }
+
+    if (!zip_files.empty()) {
+       retval = appendArchive(archive,zip_files,job.zip_threads,job.codec);
+       for (auto &sidecar : sidecars) fs::remove(sidecar,ec);
+       if (retval) {
+          fprintf(stderr,"..Zipping up file %s failed\n",upload_part.c_str());
+          return retval;
+       }
+
+       // Files have been successfully zipped, they can now be deleted, apart from the reference of the next delta
+       if (job.remove_files) {
+          for (auto &file : files) {
+             if (file != packager.delta_reference) fs::remove(file,ec);
+          }
+       }
+    }
+    if (!job.finish) return 0;
+
+    // Add the summaries of the ICMGG files, listed first in the zip. Under BOINC the summary is also kept as its own
+    // small upload file so that the server has it ahead of the zip.
+    if (!packager.summary.empty()) {
+       std::string summary_file = fs::path(upload_part).parent_path().string() + std::string("/diagnostics_") +
+                                  std::to_string(job.upload_file_number) + std::string(".txt");
+       std::ofstream summary(summary_file);
+       summary << "# file param level_type level mean min max mean_90S_30S mean_30S_30N mean_30N_90N histogram\n";
+       summary << packager.summary;
+       summary.close();
+       ZipFileList summary_files;
+       summary_files.push_back(summary_file);
+       if (summary.fail() || appendArchive(archive,summary_files,1,job.codec))
+          fprintf(stderr,"..Adding the diagnostics file %s failed\n",summary_file.c_str());
+       else
+          archive.first_entry = stripPath(summary_file.c_str());
+       if (summary.fail() || job.summary_file.empty() || rename(summary_file.c_str(),job.summary_file.c_str()) != 0)
+          fs::remove(summary_file,ec);
+    }
+    dropDeltaReference(packager);
+    packager.summary.clear();
+    packager.archive_number = 0;
+
+    // An upload file with no output files is not uploaded
+    if (archive.entries.empty()) {
+       closeArchive(archive);
+       fs::remove(upload_part,ec);
+       fs::remove(upload_part + std::string(".entries"),ec);
+       job.upload_file_name.clear();
+       return 0;
+    }
+
+    if (finishArchive(archive)) return 1;
+    fprintf(stderr,"Zipped %lu files of %.1f MB into %.1f MB with %s in %.2f seconds, %.1f MB saved per CPU second\n",
+            (unsigned long) archive.entries.size(),archive.stats.bytes_in / 1.0e6,archive.stats.bytes_out / 1.0e6,
+            job.codec.name.c_str(),archive.stats.seconds,
+            ((double) archive.stats.bytes_in - (double) archive.stats.bytes_out) / 1.0e6 /
+            std::max(archive.stats.cpu_seconds,1.0e-3));
+
+    fd = open(upload_part.c_str(),O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+       fprintf(stderr,"..Flushing the file %s failed\n",upload_part.c_str());
+       if (fd >= 0) close(fd);
+       return 1;
+    }
+    close(fd);
+
+    if (rename(upload_part.c_str(),job.upload_file.c_str()) != 0) {
+       fprintf(stderr,"..Renaming %s to %s failed\n",upload_part.c_str(),job.upload_file.c_str());
+       return 1;
+    }
+
+    // Flush the rename to disk
+    fd = open(fs::path(job.upload_file).parent_path().c_str(),O_RDONLY);
+    if (fd >= 0) {
+       fsync(fd);
+       close(fd);
+    }
+    return 0;
+}
+
+// Remove the reference file of the deltas once it is no longer needed
+void dropDeltaReference(UPLOAD_PACKAGER &packager) {
+    std::error_code ec;
+    if (!packager.delta_reference.empty() && packager.remove_delta_reference) fs::remove(packager.delta_reference,ec);
+    packager.delta_reference.clear();
+    packager.remove_delta_reference = false;
+}
+
+// Start the packaging thread
+void startPackager(UPLOAD_PACKAGER &packager) {
+    packager.worker = std::thread(runPackager,&packager);
+}
+
+// The packaging thread, packages the queued upload jobs in order until it is stopped and the queue is empty
+void runPackager(UPLOAD_PACKAGER *packager) {
+    // The packaging is done at idle I/O priority so that it does not compete with the model
+    if (setIdleIOPriority()) fprintf(stderr,"..Setting the packaging thread to idle I/O priority failed\n");
+
+    std::unique_lock<std::mutex> guard(packager->lock);
+    while (true) {
+       packager->changed.wait(guard,[packager]() {
+          return packager->stopping || (!packager->held && !packager->pending.empty()); });
+       if (packager->pending.empty()) break;
+
+       UPLOAD_JOB job = packager->pending.front();
+       guard.unlock();
+
+       auto package_start = steady_clock::now();
+       int retval = packageUpload(*packager,job);
+       fprintf(stderr,"%s %s took %.2f seconds\n",job.finish ? "Finishing" : "Appending to",stripPath(job.upload_file.c_str()),
+               duration<double>(steady_clock::now() - package_start).count());
+       fflush(stderr);
+
+       guard.lock();
+       packager->pending.pop_front();
+       if (retval) {
+          packager->retval = retval;
+          packager->pending.clear();
+          break;
+       }
+       if (job.finish) packager->finished.push_back(job);
+       packager->changed.notify_all();
+    }
+}
+
+// Queue an upload job for packaging, returns false without blocking if the queue is full
+bool queueUpload(UPLOAD_PACKAGER &packager, const UPLOAD_JOB &job) {
+    std::lock_guard<std::mutex> guard(packager.lock);
+    if (packager.pending.size() >= packager.max_pending) return false;
+    packager.pending.push_back(job);
+    packager.changed.notify_all();
+    return true;
+}
+
+// Take the next packaged upload job, returns false if none is ready
+bool takeFinishedUpload(UPLOAD_PACKAGER &packager, UPLOAD_JOB &job) {
+    std::lock_guard<std::mutex> guard(packager.lock);
+    if (packager.finished.empty()) return false;
+    job = packager.finished.front();
+    packager.finished.pop_front();
+    return true;
+}
+
+// Wait for the queued upload jobs to be packaged and stop the packaging thread
+void stopPackager(UPLOAD_PACKAGER &packager) {
+    {
+       std::lock_guard<std::mutex> guard(packager.lock);
+       packager.stopping = true;
+       packager.changed.notify_all();
+    }
+    if (packager.worker.joinable()) packager.worker.join();
+}
+
+// Whether upload jobs are waiting to be packaged
+bool packagerBusy(UPLOAD_PACKAGER &packager) {
+    std::lock_guard<std::mutex> guard(packager.lock);
+    return !packager.pending.empty();
+}
+
+// Hold back or release the pending upload jobs, the jobs are packaged regardless once the packager is stopping
+void holdPackager(UPLOAD_PACKAGER &packager, bool held) {
+    std::lock_guard<std::mutex> guard(packager.lock);
+    if (packager.held == held) return;
+    packager.held = held;
+    packager.changed.notify_all();
+}
+
+// Move the packaging thread to or from the idle CPU scheduling class, below even the nice 19 the BOINC client runs
+// the task at. The threads it starts to compress the zip from then on inherit the class.
+int setPackagerIdle(UPLOAD_PACKAGER &packager, bool idle) {
+    if (packager.idle_priority == idle || !packager.worker.joinable()) return 0;
+    #ifndef __APPLE__ // Linux
+       struct sched_param param;
+       param.sched_priority = 0;
+       if (pthread_setschedparam(packager.worker.native_handle(),idle ? SCHED_IDLE : SCHED_OTHER,&param) != 0) return 1;
+    #endif
+    packager.idle_priority = idle;
+    return 0;
+}
+
+// Set the calling thread to the idle I/O scheduling class
+int setIdleIOPriority() {
+    #ifndef __APPLE__ // Linux
+       const int ioprio_who_process = 1, ioprio_class_idle = 3, ioprio_class_shift = 13;
+       return syscall(SYS_ioprio_set,ioprio_who_process,0,ioprio_class_idle << ioprio_class_shift) == 0 ? 0 : 1;
+    #else // macOS
+       return setiopolicy_np(IOPOL_TYPE_DISK,IOPOL_SCOPE_THREAD,IOPOL_THROTTLE);
+    #endif
+}
+
+
+// Check the disk used by the slot and the task's upload zips against the disk bound. The model is paused when the
+// bound is close and resumed once the uploads have drained, as long as there are uploads or packaging to wait on.
+void checkDiskBudget(DISK_BUDGET &budget, long handleProcess, bool packaging) {
+    std::error_code ec;
+    if (budget.bound <= 0) return;
+
+    // Keep the model stopped if resuming from a BOINC suspend has restarted it
+    if (budget.paused) kill(handleProcess,SIGSTOP);
+    if (steady_clock::now() - budget.last_check < seconds(5)) return;
+    budget.last_check = steady_clock::now();
+
+    // An uploaded zip is no longer needed, remove it as its space counts towards the disk bound until the task ends
+    for (auto upload = budget.uploading.begin(); upload != budget.uploading.end();) {
+       if (boinc_upload_status(upload->second) == 0) {
+          fprintf(stderr,"The upload of %s has completed, removing it\n",upload->second.c_str());
+          fs::remove(upload->first,ec);
+          upload = budget.uploading.erase(upload);
+       }
+       else upload++;
+    }
+
+    // The slot folder and the task's upload zips, including those still being written
+    budget.used = (double) directorySize(budget.slot_path);
+    std::string project_path = budget.upload_prefix.substr(0,budget.upload_prefix.rfind('/')+1);
+    std::string prefix = budget.upload_prefix.substr(project_path.size());
+    for (auto &item : fs::directory_iterator(project_path,ec)) {
+       if (item.path().filename().string().compare(0,prefix.size(),prefix) == 0 && item.is_regular_file(ec))
+          budget.used += (double) item.file_size(ec);
+    }
+
+    bool draining = packaging || !budget.uploading.empty();
+    if (!budget.paused && budget.used > budget.pause_fraction * budget.bound) {
+       if (draining) {
+          fprintf(stderr,"..Disk use of %.0f MB is near the disk bound of %.0f MB, pausing the model while the uploads drain\n",
+                  budget.used/1e6,budget.bound/1e6);
+          fflush(stderr);
+          kill(handleProcess,SIGSTOP);
+          budget.paused = true;
+          budget.pause_start = steady_clock::now();
+       }
+       else if (!budget.warned) {
+          fprintf(stderr,"..Disk use of %.0f MB is near the disk bound of %.0f MB with no uploads to wait on\n",
+                  budget.used/1e6,budget.bound/1e6);
+          budget.warned = true;
+       }
+    }
+    else if (budget.paused && (budget.used < budget.resume_fraction * budget.bound || !draining)) {
+       fprintf(stderr,"Disk use is down to %.0f MB, resuming the model after %.0f seconds\n",budget.used/1e6,
+               duration<double>(steady_clock::now() - budget.pause_start).count());
+       fflush(stderr);
+       kill(handleProcess,SIGCONT);
+       budget.paused = false;
+    }
+}
+
+// Check the CPU, memory and I/O pressure of the host and step the throttling of the packaging and the model up or
+// down a level at a time, so that the cheaper responses are tried first. A level is left once the pressure has been
+// below it for 30 seconds. The packaging is not held while the disk budget is waiting on it.
+void checkPressure(PRESSURE_POLICY &policy, long handleProcess, UPLOAD_PACKAGER &packager, bool disk_paused) {
+    // The avg10 of the 'some' CPU pressure and of the 'full' memory and I/O pressure that enter levels 1, 2 and 3
+    const double cpu_levels[3] = {40,60,80}, memory_levels[3] = {5,10,20}, io_levels[3] = {10,20,40};
+    const char *actions[4] = {"running normally","deferring the packaging","packaging at idle CPU priority","pausing the model"};
+
+    if (!policy.available) return;
+
+    // Keep the model stopped if resuming from a BOINC suspend or the disk budget has restarted it
+    if (policy.level >= 3) kill(handleProcess,SIGSTOP);
+    holdPackager(packager,policy.level >= 1 && !disk_paused);
+
+    auto now = steady_clock::now();
+    if (now - policy.last_check < seconds(5)) return;
+    policy.last_check = now;
+
+    policy.cpu = std::max(readPressure("cpu","some"),0.0);
+    policy.memory = std::max(readPressure("memory","full"),0.0);
+    policy.io = std::max(readPressure("io","full"),0.0);
+    policy.peak_cpu = std::max(policy.peak_cpu,policy.cpu);
+    policy.peak_memory = std::max(policy.peak_memory,policy.memory);
+    policy.peak_io = std::max(policy.peak_io,policy.io);
+
+    int target = 0;
+    while (target < 3 && (policy.cpu > cpu_levels[target] || policy.memory > memory_levels[target] ||
+                          policy.io > io_levels[target])) target++;
+    // After a long pause the model is left to run for as long again before it is paused once more
+    if (target == 3 && now < policy.pause_blocked_until) target = 2;
+
+    int level = policy.level;
+    if (target > policy.level) {
+       level = policy.level + 1;
+       policy.calm = false;
+    }
+    else if (target < policy.level) {
+       if (!policy.calm) {
+          policy.calm = true;
+          policy.calm_start = now;
+       }
+       if (now - policy.calm_start >= seconds(30)) {
+          level = policy.level - 1;
+          policy.calm = false;
+       }
+    }
+    else policy.calm = false;
+
+    if (policy.level == 3 && level == 3 && now - policy.level_start > seconds(600)) {
+       fprintf(stderr,"..The model has been paused for host pressure for %.0f seconds, letting it run\n",
+               duration<double>(now - policy.level_start).count());
+       policy.pause_blocked_until = now + seconds(600);
+       level = 2;
+    }
+    if (level == policy.level) return;
+
+    double at_level = duration<double>(now - policy.level_start).count();
+    if (policy.level > 0) policy.level_seconds[policy.level] += at_level;
+    fprintf(stderr,"Host pressure cpu %.1f%%, memory %.1f%%, io %.1f%%: %s after %.0f seconds %s\n",policy.cpu,
+            policy.memory,policy.io,actions[level],policy.level > 0 ? at_level : 0.0,
+            policy.level > 0 ? actions[policy.level] : "without throttling");
+    fflush(stderr);
+
+    if ((level >= 2) != (policy.level >= 2) && setPackagerIdle(packager,level >= 2))
+       fprintf(stderr,"..Changing the CPU priority of the packaging thread failed\n");
+    if (level >= 3 && policy.level < 3) kill(handleProcess,SIGSTOP);
+    if (level < 3 && policy.level >= 3 && !disk_paused) kill(handleProcess,SIGCONT);
+    holdPackager(packager,level >= 1 && !disk_paused);
+
+    policy.level = level;
+    policy.level_start = now;
+}
+
+// Read the avg10 of a 'some' or 'full' line of a /proc/pressure file, returns -1 if it cannot be read
+double readPressure(const char *resource, const char *kind) {
+    std::ifstream pressure_file(std::string("/proc/pressure/") + resource);
+    std::string line, name, field;
+    while (std::getline(pressure_file,line)) {
+       std::istringstream fields(line);
+       if (!(fields >> name) || name != kind) continue;
+       while (fields >> field) {
+          if (field.compare(0,6,"avg10=") == 0) return atof(field.c_str() + 6);
+       }
+    }
+    return -1;
+}
+
+// Create the ring file of the resource samples, replacing any left by an earlier run
+int openSampler(RESOURCE_SAMPLER &sampler, const std::string &ring_path, int interval) {
+    sampler.ring_path = ring_path;
+    sampler.interval = interval;
+    sampler.fd = open(ring_path.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (sampler.fd < 0) {
+       fprintf(stderr,"..Creating the resource sample file %s failed\n",ring_path.c_str());
+       sampler.interval = 0;
+       return 1;
+    }
+
+    std::vector<unsigned char> header = {'O','R','N','G'};
+    appendLE(header,1,4);
+    appendLE(header,84,4);
+    appendLE(header,sampler.capacity,4);
+    appendLE(header,(uint64_t) interval,4);
+    appendLE(header,0,8);
+    appendLE(header,0,4);
+    if (pwrite(sampler.fd,header.data(),header.size(),0) != (ssize_t) header.size()) {
+       fprintf(stderr,"..Writing the resource sample file %s failed\n",ring_path.c_str());
+       close(sampler.fd);
+       sampler.fd = -1;
+       sampler.interval = 0;
+       return 1;
+    }
+    sampler.start = steady_clock::now();
+    sampler.last_sample = sampler.start;
+    return 0;
+}
+
+// Read the resources used by the model process and its threads, returns non-zero if the process cannot be read
+int readSample(long handleProcess, RESOURCE_SAMPLE &sample) {
+    #ifndef __APPLE__ // Linux
+       std::string proc_path = std::string("/proc/") + std::to_string(handleProcess);
+       std::string line, name;
+       uint64_t value;
+
+       // The state is the 3rd field, a model that has ended is not sampled. The major faults of the process and its
+       // ended threads are the 12th field.
+       std::ifstream stat_file(proc_path + std::string("/stat"));
+       if (!std::getline(stat_file,line) || line.rfind(')') == std::string::npos) return 1;
+       std::istringstream stat_fields(line.substr(line.rfind(')')+1));
+       std::string field;
+       for (int ii = 3; ii <= 12 && (stat_fields >> field); ii++) {
+          if (ii == 3 && (field == "Z" || field == "X")) return 1;
+          if (ii == 12) sample.major_faults = strtoull(field.c_str(),NULL,10);
+       }
+
+       // The resident memory and its peak, in kB
+       std::ifstream status_file(proc_path + std::string("/status"));
+       if (!status_file) return 1;
+       while (std::getline(status_file,line)) {
+          std::istringstream fields(line);
+          if (!(fields >> name >> value)) continue;
+          if (name == "VmRSS:") sample.rss = value * 1024;
+          else if (name == "VmHWM:") sample.peak_rss = value * 1024;
+       }
+
+       std::ifstream io_file(proc_path + std::string("/io"));
+       while (std::getline(io_file,line)) {
+          std::istringstream fields(line);
+          if (!(fields >> name >> value)) continue;
+          if (name == "read_bytes:") sample.read_bytes = value;
+          else if (name == "write_bytes:") sample.write_bytes = value;
+       }
+
+       // The context switches and the scheduler times are kept per thread
+       std::error_code ec;
+       sample.threads = 0;
+       for (auto &task : fs::directory_iterator(proc_path + std::string("/task"),ec)) {
+          std::ifstream task_status(task.path().string() + std::string("/status"));
+          while (std::getline(task_status,line)) {
+             std::istringstream fields(line);
+             if (!(fields >> name >> value)) continue;
+             if (name == "voluntary_ctxt_switches:") sample.voluntary_switches += value;
+             else if (name == "nonvoluntary_ctxt_switches:") sample.involuntary_switches += value;
+          }
+          std::ifstream schedstat_file(task.path().string() + std::string("/schedstat"));
+          uint64_t run_ns, delay_ns;
+          if (schedstat_file >> run_ns >> delay_ns) {
+             sample.run_ns += run_ns;
+             sample.delay_ns += delay_ns;
+          }
+          sample.threads++;
+       }
+    #else // macOS
+       // The page-ins stand in for the major faults, the run queue delay and the I/O are not available
+       struct proc_taskinfo task_info;
+       if (proc_pidinfo((int) handleProcess,PROC_PIDTASKINFO,0,&task_info,sizeof(task_info)) != (int) sizeof(task_info)) return 1;
+       sample.rss = task_info.pti_resident_size;
+       sample.peak_rss = task_info.pti_resident_size;
+       sample.major_faults = (uint64_t) task_info.pti_pageins;
+       sample.voluntary_switches = (uint64_t) task_info.pti_csw;
+       sample.run_ns = task_info.pti_total_user + task_info.pti_total_system;
+       sample.threads = (uint32_t) task_info.pti_threadnum;
+    #endif
+    return 0;
+}
+
+// Take a sample of the model once the interval has passed and write it to the next record of the ring file
+void takeSample(RESOURCE_SAMPLER &sampler, long handleProcess, int step) {
+    if (sampler.interval <= 0 || sampler.fd < 0) return;
+    auto now = steady_clock::now();
+    if (sampler.nsamples > 0 && now - sampler.last_sample < seconds(sampler.interval)) return;
+    sampler.last_sample = now;
+
+    double cpu_start = threadCpuSeconds();
+    RESOURCE_SAMPLE sample;
+    if (readSample(handleProcess,sample)) return;
+    sample.seconds = (uint32_t) duration<double>(now - sampler.start).count();
+    sample.step = (uint32_t) std::max(step,0);
+
+    std::vector<unsigned char> record;
+    appendLE(record,sample.seconds,4);
+    appendLE(record,sample.step,4);
+    appendLE(record,sample.threads,4);
+    appendLE(record,sample.rss,8);
+    appendLE(record,sample.peak_rss,8);
+    appendLE(record,sample.major_faults,8);
+    appendLE(record,sample.read_bytes,8);
+    appendLE(record,sample.write_bytes,8);
+    appendLE(record,sample.voluntary_switches,8);
+    appendLE(record,sample.involuntary_switches,8);
+    appendLE(record,sample.run_ns,8);
+    appendLE(record,sample.delay_ns,8);
+    off_t offset = 32 + (off_t) (sampler.nsamples % sampler.capacity) * (off_t) record.size();
+    if (pwrite(sampler.fd,record.data(),record.size(),offset) != (ssize_t) record.size()) {
+       fprintf(stderr,"..Writing the resource sample file %s failed, no more samples are taken\n",sampler.ring_path.c_str());
+       sampler.interval = 0;
+       return;
+    }
+    sampler.nsamples++;
+    std::vector<unsigned char> count;
+    appendLE(count,sampler.nsamples,8);
+    if (pwrite(sampler.fd,count.data(),count.size(),20) != (ssize_t) count.size()) sampler.interval = 0;
+
+    // Sum the counters, a counter that has gone back belongs to a relaunched model and counts from zero
+    auto add = [](uint64_t &total, uint64_t value, uint64_t previous) { total += (value >= previous) ? value - previous : value; };
+    add(sampler.totals.major_faults,sample.major_faults,sampler.last.major_faults);
+    add(sampler.totals.read_bytes,sample.read_bytes,sampler.last.read_bytes);
+    add(sampler.totals.write_bytes,sample.write_bytes,sampler.last.write_bytes);
+    add(sampler.totals.voluntary_switches,sample.voluntary_switches,sampler.last.voluntary_switches);
+    add(sampler.totals.involuntary_switches,sample.involuntary_switches,sampler.last.involuntary_switches);
+    add(sampler.totals.run_ns,sample.run_ns,sampler.last.run_ns);
+    add(sampler.totals.delay_ns,sample.delay_ns,sampler.last.delay_ns);
+    sampler.totals.peak_rss = std::max(sampler.totals.peak_rss,sample.peak_rss);
+    sampler.max_rss = std::max(sampler.max_rss,sample.rss);
+    sampler.max_threads = std::max(sampler.max_threads,sample.threads);
+    sampler.rss_sum += (double) sample.rss;
+    sampler.last = sample;
+
+    sampler.cpu_seconds += threadCpuSeconds() - cpu_start;
+}
+
+// Close the ring file and write the summary of the samples, returns non-zero if there is no summary
+int closeSampler(RESOURCE_SAMPLER &sampler, const std::string &summary_path) {
+    if (sampler.fd < 0) return 1;
+    close(sampler.fd);
+    sampler.fd = -1;
+    if (sampler.nsamples == 0) return 1;
+
+    double run_seconds = sampler.totals.run_ns / 1e9, delay_seconds = sampler.totals.delay_ns / 1e9;
+    std::ofstream summary_file(summary_path);
+    summary_file << "samples " << sampler.nsamples << "\n"
+                 << "interval_seconds " << sampler.interval << "\n"
+                 << "elapsed_seconds " << sampler.last.seconds << "\n"
+                 << "last_step " << sampler.last.step << "\n"
+                 << "max_threads " << sampler.max_threads << "\n"
+                 << "mean_rss_mb " << (uint64_t) (sampler.rss_sum / sampler.nsamples / 1e6) << "\n"
+                 << "max_rss_mb " << (uint64_t) (sampler.max_rss / 1e6) << "\n"
+                 << "peak_rss_mb " << (uint64_t) (sampler.totals.peak_rss / 1e6) << "\n"
+                 << "major_faults " << sampler.totals.major_faults << "\n"
+                 << "read_mb " << (uint64_t) (sampler.totals.read_bytes / 1e6) << "\n"
+                 << "write_mb " << (uint64_t) (sampler.totals.write_bytes / 1e6) << "\n"
+                 << "voluntary_switches " << sampler.totals.voluntary_switches << "\n"
+                 << "involuntary_switches " << sampler.totals.involuntary_switches << "\n"
+                 << "run_seconds " << (uint64_t) run_seconds << "\n"
+                 << "run_queue_delay_seconds " << (uint64_t) delay_seconds << "\n"
+                 << "run_queue_delay_percent " << (run_seconds + delay_seconds > 0 ? 100 * delay_seconds / (run_seconds + delay_seconds) : 0.0) << "\n"
+                 << "sampler_cpu_seconds " << sampler.cpu_seconds << "\n";
+    summary_file.close();
+    if (!summary_file) {
+       fprintf(stderr,"..Writing the resource summary file %s failed\n",summary_path.c_str());
+       return 1;
+    }
+    fprintf(stderr,"Took %llu resource samples of the model at a CPU cost of %.3f seconds, peak RSS %.0f MB, "
+            "run queue delay %.0f seconds\n",(unsigned long long) sampler.nsamples,sampler.cpu_seconds,
+            sampler.totals.peak_rss / 1e6,delay_seconds);
+    return 0;
+}
 
-             fd = open(zip_position.name,O_RDWR|O_TRUNC|O_CREAT,0755);
-             if (fd < 0) {
-                fprintf(stderr,"..Failed to open file in zip\n");
-                retval=1;
+// Hand the summary of an upload file to the BOINC client ahead of the zip, its small size gets it to the server first
+void uploadSummary(const UPLOAD_JOB &job, DISK_BUDGET &budget) {
+    if (job.summary_file_name.empty() || !fs::exists(job.summary_file)) return;
+    std::string summary_file_name = job.summary_file_name;
+    fprintf(stderr,"Uploading file: %s\n",summary_file_name.c_str());
+    fflush(stderr);
+    boinc_upload_file(summary_file_name);
+    budget.uploading.emplace_back(job.summary_file,job.summary_file_name);
+}
+
+// The total size of the regular files in a folder and its subfolders, without following links
+uint64_t directorySize(const std::string &path) {
+    std::error_code ec;
+    struct stat st;
+    uint64_t total = 0;
+
+    for (auto &item : fs::recursive_directory_iterator(path,ec)) {
+       if (lstat(item.path().c_str(),&st) == 0 && S_ISREG(st.st_mode)) total += (uint64_t) st.st_size;
+    }
+    return total;
+}
+
+
+// Write the run journal to a temporary file, flush it to disk and rename it into place so that it is never partial
+int saveRunState(const RUN_STATE &state) {
+    std::string state_tmp = state.path + std::string(".tmp");
+    std::string text = std::string("staged ") + std::to_string(state.staged ? 1 : 0) + std::string("\n") +
+                       std::string("last_upload ") + std::to_string(state.last_upload) + std::string("\n") +
+                       std::string("restart_step ") + std::to_string(state.restart_step) + std::string("\n");
+
+    int fd = open(state_tmp.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd < 0 || write(fd,text.c_str(),text.length()) != (ssize_t) text.length() || fsync(fd) != 0) {
+       fprintf(stderr,"..Writing the run state file %s failed\n",state_tmp.c_str());
+       if (fd >= 0) close(fd);
+       return 1;
+    }
+    close(fd);
+    if (rename(state_tmp.c_str(),state.path.c_str()) != 0) {
+       fprintf(stderr,"..Renaming the run state file %s failed\n",state_tmp.c_str());
+       return 1;
+    }
+
+    // Flush the rename to disk
+    fd = open(fs::path(state.path).parent_path().c_str(),O_RDONLY);
+    if (fd >= 0) {
+       fsync(fd);
+       close(fd);
+    }
+    return 0;
+}
+
+// Read the run journal, returns non-zero if there is none
+int loadRunState(RUN_STATE &state) {
+    std::ifstream state_file(state.path);
+    std::string key;
+    int value;
+    if (!state_file.is_open()) return 1;
+
+    while (state_file >> key >> value) {
+       if (key == "staged") state.staged = (value != 0);
+       else if (key == "last_upload") state.last_upload = value;
+       else if (key == "restart_step") state.restart_step = value;
+    }
+    return 0;
+}
+
+// Return the step of the restart dump recorded by CSTEP in the model's rcf file, or -1 if there is none
+int readRestartStep(const std::string &slot_path) {
+    std::ifstream rcf_file(slot_path + std::string("/rcf"));
+    std::string line;
+    if (!rcf_file.is_open()) return -1;
+
+    while (std::getline(rcf_file,line)) {
+       size_t found = line.find("CSTEP");
+       if (found == std::string::npos) continue;
+       size_t digits = line.find_first_of("0123456789",line.find('=',found));
+       if (digits == std::string::npos) return -1;
+       return atoi(line.c_str()+digits);
+    }
+    return -1;
+}
+
+// A block of a file being compressed into a zip, each block is compressed independently
+struct ZIP_BLOCK {
+    size_t entry;                       // the index of the file in the files being appended
+    uint64_t offset, length;            // the part of the file
+    bool first, last;                   // the first or last block of the file
+    std::vector<unsigned char> data;    // the compressed block
+    uLong crc;
+    int retval;
+    bool done;
+};
+
+// Write a zip of the files, stored without their paths
+int zipFiles(const std::string &zip_path, const ZipFileList &files, int nthreads, const UPLOAD_CODEC &codec,
+             ZIP_STATS &stats) {
+    ZIP_ARCHIVE archive;
+    int retval = openArchive(archive,zip_path,false);
+    if (!retval) retval = appendArchive(archive,files,nthreads,codec);
+    if (!retval) retval = finishArchive(archive);
+    closeArchive(archive);
+    stats = archive.stats;
+    if (retval) return retval;
+
+    fprintf(stderr,"Zipped %lu files of %.1f MB into %.1f MB with %s on %i threads in %.2f seconds, "
+            "%.1f MB saved per CPU second\n",(unsigned long) archive.entries.size(),stats.bytes_in / 1.0e6,
+            stats.bytes_out / 1.0e6,codec.name.c_str(),std::max(1,nthreads),stats.seconds,
+            ((double) stats.bytes_in - (double) stats.bytes_out) / 1.0e6 / std::max(stats.cpu_seconds,1.0e-3));
+    return 0;
+}
+
+// Open a zip to append entries to. When resuming, the entries saved by an earlier run are kept and anything written
+// after them is discarded, otherwise the zip is started empty.
+int openArchive(ZIP_ARCHIVE &archive, const std::string &zip_path, bool resume) {
+    std::string state_path = zip_path + std::string(".entries");
+    std::error_code ec;
+
+    closeArchive(archive);
+    archive = ZIP_ARCHIVE();
+    archive.path = zip_path;
+    if (resume && fs::exists(zip_path,ec) && !loadArchiveState(archive)) {
+       archive.fd = open(zip_path.c_str(),O_WRONLY);
+       if (archive.fd >= 0 && ftruncate(archive.fd,(off_t) archive.offset) == 0) {
+          fprintf(stderr,"Resuming the zip file %s with %lu files\n",zip_path.c_str(),(unsigned long) archive.entries.size());
+          return 0;
+       }
+       closeArchive(archive);
+       archive = ZIP_ARCHIVE();
+       archive.path = zip_path;
+    }
+
+    fs::remove(state_path,ec);
+    archive.fd = open(zip_path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (archive.fd < 0) {
+       fprintf(stderr,"..Creating the zip file %s failed\n",zip_path.c_str());
+       return 1;
+    }
+    return 0;
+}
+
+// Compress the files into entries appended to a zip. Large files are split into blocks that are compressed in
+// parallel and the block CRCs are combined. With deflate every block but the last of a file ends on a byte boundary
+// with a sync flush so the blocks join into a single deflate stream, with zstd each block is a zstd frame and the
+// frames are concatenated. Zip64 sizes are used for large files.
+int appendArchive(ZIP_ARCHIVE &archive, const ZipFileList &files, int nthreads, const UPLOAD_CODEC &codec) {
+    // Long distance matching needs blocks much larger than its window to find distant matches
+    const uint64_t block_size = (codec.long_distance ? 64 : 4) * 1024 * 1024, zip32_limit = 0xFFFFFFFF;
+    const int zip_version = (codec.method == 93) ? 63 : 20;
+    const uint64_t zip64_reserve = 0xF0000000;     // files this large reserve room for zip64 sizes in the local header
+    std::vector<ZIP_ENTRY> entries;
+    std::vector<int> file_fds;
+    std::vector<ZIP_BLOCK> blocks;
+    std::vector<unsigned char> header;
+    uint64_t offset = archive.offset, total_in = 0;
+    double cpu_seconds = 0;
+    int retval = 0;
+
+    if (archive.fd < 0) return 1;
+    if (codec.method != 0 && codec.method != 8 && codec.method != 93) {
+       fprintf(stderr,"..The zip compression method %i is not supported\n",codec.method);
+       return 1;
+    }
+
+    auto zip_start = steady_clock::now();
+    nthreads = std::max(1,nthreads);
+
+    // Open the files and split them into blocks
+    for (auto &file : files) {
+       ZIP_ENTRY entry;
+       struct stat st;
+       entry.name = stripPath(file.c_str());
+       int file_fd = open(file.c_str(),O_RDONLY);
+       if (file_fd < 0 || fstat(file_fd,&st) != 0) {
+          fprintf(stderr,"..Opening the file %s to zip failed\n",file.c_str());
+          if (file_fd >= 0) close(file_fd);
+          retval = 1;
+          break;
+       }
+       struct tm mtime;
+       localtime_r(&st.st_mtime,&mtime);
+       entry.dos_time = (uint16_t) ((mtime.tm_hour << 11) | (mtime.tm_min << 5) | (mtime.tm_sec / 2));
+       entry.dos_date = (uint16_t) ((std::max(mtime.tm_year - 80,0) << 9) | ((mtime.tm_mon + 1) << 5) | mtime.tm_mday);
+       entry.mode = st.st_mode;
+       entry.method = codec.method;
+       entry.size = (uint64_t) st.st_size;
+       entry.compressed = 0;
+       entry.header_offset = 0;
+       entry.crc = crc32(0L,Z_NULL,0);
+       entry.zip64 = (entry.size >= zip64_reserve);
+       total_in += entry.size;
+
+       uint64_t nblocks = std::max((uint64_t) 1,(entry.size + block_size - 1) / block_size);
+       for (uint64_t ii = 0; ii < nblocks; ii++) {
+          ZIP_BLOCK block;
+          block.entry = entries.size();
+          block.offset = ii * block_size;
+          block.length = std::min(block_size,entry.size - block.offset);
+          block.first = (ii == 0);
+          block.last = (ii == nblocks - 1);
+          block.crc = 0;
+          block.retval = 0;
+          block.done = false;
+          blocks.push_back(block);
+       }
+       entries.push_back(entry);
+       file_fds.push_back(file_fd);
+    }
+
+    int zip_fd = archive.fd;
+    // Write the whole of a buffer at an offset
+    auto writeAt = [&](const unsigned char *buffer, size_t length, uint64_t at) {
+       while (length > 0) {
+          ssize_t written = pwrite(zip_fd,buffer,length,(off_t) at);
+          if (written <= 0) {
+             if (written < 0 && errno == EINTR) continue;
+             return 1;
+          }
+          buffer += written;
+          length -= written;
+          at += written;
+       }
+       return 0;
+    };
+
+    // The compression threads take the blocks in order, at most a window of blocks ahead of the writer
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t next_block = 0, next_write = 0, window = 2 * (size_t) nthreads;
+    bool failed = (retval != 0);
+    std::vector<std::thread> workers;
+
+    auto compressBlocks = [&]() {
+       std::vector<unsigned char> input;
+       struct timespec cpu_start, cpu_end;
+       clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_start);
+#ifdef HAVE_ZSTD
+       ZSTD_CCtx *cctx = NULL;
+       if (codec.method == 93) {
+          cctx = ZSTD_createCCtx();
+          ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,codec.level);
+          if (codec.long_distance) {
+             ZSTD_CCtx_setParameter(cctx,ZSTD_c_enableLongDistanceMatching,1);
+             ZSTD_CCtx_setParameter(cctx,ZSTD_c_windowLog,27);
+          }
+       }
+#endif
+       std::unique_lock<std::mutex> guard(lock);
+       while (true) {
+          changed.wait(guard,[&]() { return failed || next_block >= blocks.size() || next_block < next_write + window; });
+          if (failed || next_block >= blocks.size()) break;
+          ZIP_BLOCK &block = blocks[next_block++];
+          guard.unlock();
+
+          // Read the block
+          input.resize(block.length);
+          size_t got = 0;
+          while (got < block.length) {
+             ssize_t nread = pread(file_fds[block.entry],input.data() + got,block.length - got,(off_t) (block.offset + got));
+             if (nread <= 0) {
+                if (nread < 0 && errno == EINTR) continue;
+                block.retval = 1;
+                break;
              }
+             got += nread;
+          }
 
-             sum = 0;
-             while (sum != zip_position.size) {
-                len = zip_fread(zf, buf, 100);
-                if (len < 0) {
-                   fprintf(stderr,"..File in zip is of zero size\n");
-                   retval=1;
-                }
-                write(fd, buf, len);
-                sum += len;
+          // Compress the block
+          if (!block.retval) block.crc = crc32(crc32(0L,Z_NULL,0),input.data(),(uInt) block.length);
+          if (!block.retval && codec.method == 0) {
+             block.data.assign(input.begin(),input.end());
+          }
+          else if (!block.retval && codec.method == 8) {
+             z_stream stream;
+             memset(&stream,0,sizeof(stream));
+             if (deflateInit2(&stream,codec.level,Z_DEFLATED,-MAX_WBITS,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+                block.retval = 1;
+             }
+             else {
+                block.data.resize(deflateBound(&stream,block.length) + 16);
+                stream.next_in = input.data();
+                stream.avail_in = (uInt) block.length;
+                stream.next_out = block.data.data();
+                stream.avail_out = (uInt) block.data.size();
+                int status = deflate(&stream,block.last ? Z_FINISH : Z_SYNC_FLUSH);
+                if ((block.last && status != Z_STREAM_END) || (!block.last && status != Z_OK) || stream.avail_in != 0)
+                   block.retval = 1;
+                block.data.resize(stream.total_out);
+                deflateEnd(&stream);
+             }
+          }
+#ifdef HAVE_ZSTD
+          else if (!block.retval && codec.method == 93 && cctx) {
+             block.data.resize(ZSTD_compressBound(block.length));
+             size_t compressed = ZSTD_compress2(cctx,block.data.data(),block.data.size(),input.data(),block.length);
+             if (ZSTD_isError(compressed)) block.retval = 1;
+             else block.data.resize(compressed);
+          }
+#endif
+          else {
+             block.retval = 1;
+          }
+
+          guard.lock();
+          block.done = true;
+          changed.notify_all();
+       }
+#ifdef HAVE_ZSTD
+       ZSTD_freeCCtx(cctx);
+#endif
+       clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_end);
+       cpu_seconds += (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1.0e9;
+    };
+    if (!failed) {
+       for (int ii = 0; ii < std::min(nthreads,(int) blocks.size()); ii++) workers.emplace_back(compressBlocks);
+    }
+
+    // Write the blocks in order, patching the CRC and sizes into the local header once the last block is written
+    while (!failed && next_write < blocks.size()) {
+       std::unique_lock<std::mutex> guard(lock);
+       changed.wait(guard,[&]() { return blocks[next_write].done; });
+       guard.unlock();
+
+       ZIP_BLOCK &block = blocks[next_write];
+       ZIP_ENTRY &entry = entries[block.entry];
+       if (block.retval) {
+          fprintf(stderr,"..Compressing the file %s failed\n",entry.name.c_str());
+          retval = 1;
+       }
+
+       if (!retval && block.first) {
+          entry.header_offset = offset;
+          header.clear();
+          appendLE(header,0x04034b50,4);
+          appendLE(header,std::max(zip_version,entry.zip64 ? 45 : 20),2);
+          appendLE(header,0,2);
+          appendLE(header,codec.method,2);
+          appendLE(header,entry.dos_time,2);
+          appendLE(header,entry.dos_date,2);
+          appendLE(header,0,4);
+          appendLE(header,entry.zip64 ? zip32_limit : 0,4);
+          appendLE(header,entry.zip64 ? zip32_limit : 0,4);
+          appendLE(header,entry.name.length(),2);
+          appendLE(header,entry.zip64 ? 20 : 0,2);
+          header.insert(header.end(),entry.name.begin(),entry.name.end());
+          if (entry.zip64) {
+             appendLE(header,0x0001,2);
+             appendLE(header,16,2);
+             appendLE(header,0,8);
+             appendLE(header,0,8);
+          }
+          if (writeAt(header.data(),header.size(),offset)) retval = 1;
+          offset += header.size();
+       }
+
+       if (!retval) {
+          if (writeAt(block.data.data(),block.data.size(),offset)) retval = 1;
+          offset += block.data.size();
+          entry.compressed += block.data.size();
+          entry.crc = crc32_combine(entry.crc,block.crc,(z_off_t) block.length);
+       }
+
+       if (!retval && block.last) {
+          if (!entry.zip64 && entry.compressed >= zip32_limit) {
+             fprintf(stderr,"..The compressed file %s is too large for its zip header\n",entry.name.c_str());
+             retval = 1;
+          }
+          else {
+             header.clear();
+             appendLE(header,entry.crc,4);
+             if (!entry.zip64) {
+                appendLE(header,entry.compressed,4);
+                appendLE(header,entry.size,4);
+             }
+             if (writeAt(header.data(),header.size(),entry.header_offset + 14)) retval = 1;
+             if (entry.zip64) {
+                header.clear();
+                appendLE(header,entry.size,8);
+                appendLE(header,entry.compressed,8);
+                if (writeAt(header.data(),header.size(),entry.header_offset + 30 + entry.name.length() + 4)) retval = 1;
              }
-             close(fd);
-             zip_fclose(zf);
           }
-       } else {
-          fprintf(stderr,"..File %s line %d\n",__FILE__,__LINE__);
-          retval=1;
        }
-    }   
 
-    if (zip_close(opened_file) == -1) {
-       fprintf(stderr,"..Zip file cannot be closed: %s\n",file_name);
-       retval=1;
+       guard.lock();
+       std::vector<unsigned char>().swap(block.data);
+       next_write++;
+       if (retval) failed = true;
+       changed.notify_all();
     }
+    for (auto &worker : workers) worker.join();
+    if (failed && !retval) retval = 1;
+    for (int file_fd : file_fds) close(file_fd);
 
-    return retval;
+    archive.stats.bytes_in += total_in;
+    archive.stats.cpu_seconds += cpu_seconds;
+    archive.stats.seconds += duration<double>(steady_clock::now() - zip_start).count();
+    if (retval) {
+       fprintf(stderr,"..Appending to the zip file %s failed\n",archive.path.c_str());
+       return retval;
+    }
+
+    // The appended entries are saved only once they are complete
+    archive.entries.insert(archive.entries.end(),entries.begin(),entries.end());
+    archive.offset = offset;
+    return saveArchiveState(archive);
+}
+
+// Write the central directory and the end of central directory records of a zip and close it. The entry named
+// first_entry is listed first.
+int finishArchive(ZIP_ARCHIVE &archive) {
+    const uint64_t zip32_limit = 0xFFFFFFFF;
+    std::vector<unsigned char> header;
+    std::vector<ZIP_ENTRY> entries = archive.entries;
+    uint64_t offset = archive.offset;
+    int retval = 0;
+    std::error_code ec;
+
+    if (archive.fd < 0) return 1;
+    std::stable_partition(entries.begin(),entries.end(),
+                          [&](const ZIP_ENTRY &entry) { return entry.name == archive.first_entry; });
+
+    uint64_t directory_offset = offset;
+    for (auto &entry : entries) {
+       std::vector<unsigned char> extra;
+       if (entry.size >= zip32_limit) appendLE(extra,entry.size,8);
+       if (entry.compressed >= zip32_limit) appendLE(extra,entry.compressed,8);
+       if (entry.header_offset >= zip32_limit) appendLE(extra,entry.header_offset,8);
+       bool zip64 = entry.zip64 || !extra.empty();
+       int zip_version = std::max((entry.method == 93) ? 63 : 20,zip64 ? 45 : 20);
+
+       appendLE(header,0x02014b50,4);
+       appendLE(header,(3 << 8) | zip_version,2);     // made on Unix
+       appendLE(header,zip_version,2);
+       appendLE(header,0,2);
+       appendLE(header,entry.method,2);
+       appendLE(header,entry.dos_time,2);
+       appendLE(header,entry.dos_date,2);
+       appendLE(header,entry.crc,4);
+       appendLE(header,std::min(entry.compressed,zip32_limit),4);
+       appendLE(header,std::min(entry.size,zip32_limit),4);
+       appendLE(header,entry.name.length(),2);
+       appendLE(header,extra.empty() ? 0 : extra.size() + 4,2);
+       appendLE(header,0,2);
+       appendLE(header,0,2);
+       appendLE(header,0,2);
+       appendLE(header,(uint64_t) (entry.mode & 0xFFFF) << 16,4);
+       appendLE(header,std::min(entry.header_offset,zip32_limit),4);
+       header.insert(header.end(),entry.name.begin(),entry.name.end());
+       if (!extra.empty()) {
+          appendLE(header,0x0001,2);
+          appendLE(header,extra.size(),2);
+          header.insert(header.end(),extra.begin(),extra.end());
+       }
+    }
+    uint64_t directory_size = header.size();
+    uint64_t end_offset = directory_offset + directory_size;
+
+    if (entries.size() >= 0xFFFF || directory_offset >= zip32_limit || directory_size >= zip32_limit) {
+       appendLE(header,0x06064b50,4);
+       appendLE(header,44,8);
+       appendLE(header,(3 << 8) | 45,2);
+       appendLE(header,45,2);
+       appendLE(header,0,4);
+       appendLE(header,0,4);
+       appendLE(header,entries.size(),8);
+       appendLE(header,entries.size(),8);
+       appendLE(header,directory_size,8);
+       appendLE(header,directory_offset,8);
+       appendLE(header,0x07064b50,4);
+       appendLE(header,0,4);
+       appendLE(header,end_offset,8);
+       appendLE(header,1,4);
+    }
+    appendLE(header,0x06054b50,4);
+    appendLE(header,0,2);
+    appendLE(header,0,2);
+    appendLE(header,std::min((uint64_t) entries.size(),(uint64_t) 0xFFFF),2);
+    appendLE(header,std::min((uint64_t) entries.size(),(uint64_t) 0xFFFF),2);
+    appendLE(header,std::min(directory_size,zip32_limit),4);
+    appendLE(header,std::min(directory_offset,zip32_limit),4);
+    appendLE(header,0,2);
+
+    const unsigned char *buffer = header.data();
+    size_t length = header.size();
+    while (length > 0) {
+       ssize_t written = pwrite(archive.fd,buffer,length,(off_t) offset);
+       if (written <= 0) {
+          if (written < 0 && errno == EINTR) continue;
+          retval = 1;
+          break;
+       }
+       buffer += written;
+       length -= written;
+       offset += written;
+    }
+    if (!retval && ftruncate(archive.fd,(off_t) offset) != 0) retval = 1;
+    if (close(archive.fd) != 0) retval = 1;
+    archive.fd = -1;
+    if (retval) {
+       fprintf(stderr,"..Writing the zip file %s failed\n",archive.path.c_str());
+       return retval;
+    }
+    archive.stats.bytes_out = offset;
+    fs::remove(archive.path + std::string(".entries"),ec);
+    return 0;
+}
+
+// Close a zip without finishing it
+void closeArchive(ZIP_ARCHIVE &archive) {
+    if (archive.fd >= 0) close(archive.fd);
+    archive.fd = -1;
+}
+
+// Whether a zip has an entry of a name
+bool archiveHasEntry(const ZIP_ARCHIVE &archive, const std::string &name) {
+    for (auto &entry : archive.entries) {
+       if (entry.name == name) return true;
+    }
+    return false;
+}
+
+// Save the entries of a zip being written to '<zip>.entries', first the end of the entries then a line for each entry
+int saveArchiveState(const ZIP_ARCHIVE &archive) {
+    std::string state_path = archive.path + std::string(".entries");
+    std::string state_tmp = state_path + std::string(".tmp");
+    std::ofstream state_file(state_tmp);
+    if (!state_file.is_open()) return 1;
+
+    state_file << archive.offset << "\n";
+    for (auto &entry : archive.entries) {
+       state_file << entry.name << " " << entry.size << " " << entry.compressed << " " << entry.header_offset << " "
+                  << entry.crc << " " << entry.zip64 << " " << entry.method << " " << entry.dos_time << " "
+                  << entry.dos_date << " " << (unsigned long) entry.mode << "\n";
+    }
+    state_file.close();
+    if (state_file.fail() || rename(state_tmp.c_str(),state_path.c_str()) != 0) {
+       fprintf(stderr,"..Saving the entries of the zip file %s failed\n",archive.path.c_str());
+       return 1;
+    }
+    return 0;
+}
+
+// Load the entries of a zip being written from '<zip>.entries'
+int loadArchiveState(ZIP_ARCHIVE &archive) {
+    std::ifstream state_file(archive.path + std::string(".entries"));
+    std::string line;
+    if (!state_file.is_open() || !(state_file >> archive.offset)) return 1;
+
+    archive.entries.clear();
+    std::getline(state_file,line);
+    while (std::getline(state_file,line)) {
+       std::istringstream fields(line);
+       ZIP_ENTRY entry;
+       unsigned long mode;
+       if (!(fields >> entry.name >> entry.size >> entry.compressed >> entry.header_offset >> entry.crc >> entry.zip64 >>
+             entry.method >> entry.dos_time >> entry.dos_date >> mode)) return 1;
+       entry.mode = (mode_t) mode;
+       archive.entries.push_back(entry);
+       archive.stats.bytes_in += entry.size;
+    }
+    return 0;
+}
+
+// Append a little endian value of a number of bytes to a buffer
+void appendLE(std::vector<unsigned char> &buffer, uint64_t value, int bytes) {
+    for (int ii = 0; ii < bytes; ii++) buffer.push_back((unsigned char) ((value >> (8 * ii)) & 0xFF));
+}
+
+// The number of cores that BOINC leaves idle under the computing preferences, at least one
+int idleCores(const APP_INIT_DATA &dataBOINC) {
+    int ncpus = dataBOINC.host_info.p_ncpus;
+    if (ncpus <= 0) ncpus = (int) std::thread::hardware_concurrency();
+    return std::max(1,ncpus - usableCores(dataBOINC));
+}
+
+// The number of cores BOINC may use on the host, from the percentage of the CPUs in the preferences
+int usableCores(const APP_INIT_DATA &dataBOINC) {
+    int ncpus = dataBOINC.host_info.p_ncpus;
+    if (ncpus <= 0) ncpus = (int) std::thread::hardware_concurrency();
+    double ncpus_pct = dataBOINC.global_prefs.max_ncpus_pct;
+    if (ncpus_pct <= 0 || ncpus_pct > 100) ncpus_pct = 100;
+    return std::max(1,(int) (ncpus * ncpus_pct / 100));
+}
+
+// The number of model threads, from the CPUs BOINC has assigned the task (the avg_ncpus of its plan class). The
+// threads are capped by the resolution, as beyond these the smaller grids gain little from more threads.
+int modelThreads(const APP_INIT_DATA &dataBOINC, int horiz_resolution) {
+    int max_threads;
+    if (horiz_resolution <= 95) max_threads = 2;
+    else if (horiz_resolution <= 159) max_threads = 4;
+    else if (horiz_resolution <= 255) max_threads = 8;
+    else if (horiz_resolution <= 511) max_threads = 16;
+    else max_threads = 32;
+
+    int nthreads = (int) (dataBOINC.ncpus + 0.5);
+    return std::max(1,std::min(std::min(nthreads,max_threads),usableCores(dataBOINC)));
 }
+
+// Parse an upload codec from 'store', 'deflate[:level]' or 'zstd[:level][:long]', returns 1 if it is not available
+int parseCodec(const std::string &spec, UPLOAD_CODEC &codec) {
+    std::vector<std::string> fields;
+    std::stringstream spec_stream(spec);
+    std::string field;
+    while (std::getline(spec_stream,field,':')) fields.push_back(field);
+    if (fields.empty()) return 1;
+
+    codec = UPLOAD_CODEC();
+    codec.long_distance = false;
+    if (fields[0] == "store" && fields.size() == 1) {
+       codec.method = 0;
+       codec.level = 0;
+       codec.name = "store";
+       return 0;
+    }
+    else if (fields[0] == "deflate" && fields.size() <= 2) {
+       codec.method = 8;
+       codec.level = (fields.size() > 1) ? atoi(fields[1].c_str()) : 9;
+       if (codec.level < 1 || codec.level > 9) return 1;
+    }
+    else if (fields[0] == "zstd" && fields.size() <= 3) {
+#ifdef HAVE_ZSTD
+       codec.method = 93;
+       codec.level = (fields.size() > 1) ? atoi(fields[1].c_str()) : 19;
+       if (codec.level < 1 || codec.level > ZSTD_maxCLevel()) return 1;
+       if (fields.size() > 2) {
+          if (fields[2] != "long") return 1;
+          codec.long_distance = true;
+       }
+#else
+       // Built without zstd
+       return 1;
 #endif
+    }
+    else {
+       return 1;
+    }
+    codec.name = fields[0] + std::string(":") + std::to_string(codec.level) + (codec.long_distance ? ":long" : "");
+    return 0;
+}
+
+// Zip the ICM output files in a folder with each of the upload codecs and report the bytes saved per CPU second
+void benchmarkCodecs(const std::string &output_path, const std::string &benchmark_path, int nthreads) {
+    const char *codecs[] = {"store","deflate:1","deflate:6","deflate:9","zstd:3","zstd:9","zstd:19","zstd:19:long"};
+    std::error_code ec;
+    ZipFileList files;
+
+    for (auto &item : fs::directory_iterator(output_path,ec)) {
+       if (item.path().filename().string().compare(0,3,"ICM") == 0) files.push_back(item.path().string());
+    }
+    if (files.empty()) {
+       fprintf(stderr,"..No ICM output files to benchmark the upload codecs with in %s\n",output_path.c_str());
+       return;
+    }
+    std::sort(files.begin(),files.end());
+
+    fs::create_directories(benchmark_path,ec);
+    std::string zip_path = benchmark_path + std::string("/benchmark.zip");
+    fprintf(stderr,"Benchmark of the upload codecs on %lu ICM files with %i threads:\n",(unsigned long) files.size(),nthreads);
+    for (const char *spec : codecs) {
+       UPLOAD_CODEC codec;
+       ZIP_STATS stats;
+       if (parseCodec(spec,codec)) {
+          fprintf(stderr,"  %-14s not available\n",spec);
+          continue;
+       }
+       int retval = zipFiles(zip_path,files,nthreads,codec,stats);
+       fprintf(stderr,"  %-14s ratio %.3f, %.2f seconds, %.2f CPU seconds, %.1f MB saved per CPU second (retval %i)\n",
+               codec.name.c_str(),stats.bytes_in ? (double) stats.bytes_out / stats.bytes_in : 0.0,stats.seconds,
+               stats.cpu_seconds,((double) stats.bytes_in - (double) stats.bytes_out) / 1.0e6 / std::max(stats.cpu_seconds,1.0e-3),
+               retval);
+       fflush(stderr);
+    }
+    fs::remove_all(benchmark_path,ec);
+}
+
+
+// Read a big endian unsigned value of a number of bytes
+uint64_t readBE(const unsigned char *buffer, int bytes) {
+    uint64_t value = 0;
+    for (int ii = 0; ii < bytes; ii++) value = (value << 8) | buffer[ii];
+    return value;
+}
+
+// Read the whole of a part of a file
+int readAt(int fd, unsigned char *buffer, size_t length, uint64_t offset) {
+    while (length > 0) {
+       ssize_t nread = pread(fd,buffer,length,(off_t) offset);
+       if (nread <= 0) {
+          if (nread < 0 && errno == EINTR) continue;
+          return 1;
+       }
+       buffer += nread;
+       length -= nread;
+       offset += nread;
+    }
+    return 0;
+}
+
+// Index the messages of a GRIB1 or GRIB2 file from their section headers, without decoding the data. Returns 1 if
+// the file is not a sequence of complete GRIB messages.
+int scanGribFile(const std::string &grib_path, std::vector<GRIB_MESSAGE> &messages) {
+    unsigned char header[64];
+    uint64_t offset = 0;
+    struct stat st;
+
+    messages.clear();
+    int fd = open(grib_path.c_str(),O_RDONLY);
+    if (fd < 0) return 1;
+    if (fstat(fd,&st) != 0) {
+       close(fd);
+       return 1;
+    }
+    uint64_t file_size = (uint64_t) st.st_size;
+
+    while (offset < file_size) {
+       GRIB_MESSAGE message;
+       message.offset = offset;
+       message.level_type = -1;
+       message.level = -1;
+       message.step = -1;
+
+       // Section 0, the indicator section
+       if (file_size - offset < 16 || readAt(fd,header,16,offset) || memcmp(header,"GRIB",4) != 0) break;
+       message.edition = header[7];
+
+       if (message.edition == 1) {
+          message.length = readBE(header + 4,3);
+
+          // Section 1, the product definition section
+          unsigned char pds[28];
+          if (readAt(fd,pds,sizeof(pds),offset + 8)) break;
+          uint64_t pds_length = readBE(pds,3);
+          int table_version = pds[3];
+          int parameter = pds[8];
+          message.param = std::to_string(table_version == 128 ? parameter : table_version * 1000 + parameter);
+          message.level_type = pds[9];
+          message.level = (long) readBE(pds + 10,2);
+          message.step = (pds[20] == 10) ? (long) readBE(pds + 18,2) : (long) pds[18];
+
+          // ECMWF large GRIB1 messages code the total length in units of 120 bytes, corrected by the length of
+          // section 4 when that is below 120
+          if (message.length & 0x800000) {
+             uint64_t section_offset = offset + 8 + pds_length;
+             unsigned char section[3];
+             if (pds[7] & 0x80) {
+                if (readAt(fd,section,3,section_offset)) break;
+                section_offset += readBE(section,3);
+             }
+             if (pds[7] & 0x40) {
+                if (readAt(fd,section,3,section_offset)) break;
+                section_offset += readBE(section,3);
+             }
+             if (readAt(fd,section,3,section_offset)) break;
+             uint64_t bds_length = readBE(section,3);
+             message.length = (message.length & 0x7FFFFF) * 120;
+             if (bds_length <= 120) message.length = message.length - bds_length + 4;
+          }
+       }
+       else if (message.edition == 2) {
+          message.length = readBE(header + 8,8);
+          int discipline = header[6];
+
+          // Walk the sections to section 4, the product definition section
+          uint64_t section_offset = offset + 16;
+          while (section_offset + 5 <= offset + message.length) {
+             unsigned char section[34];
+             if (readAt(fd,section,5,section_offset)) break;
+             if (memcmp(section,"7777",4) == 0) break;
+             uint64_t section_length = readBE(section,4);
+             if (section_length < 5) break;
+             if (section[4] == 4 && section_length >= 34 && !readAt(fd,section,34,section_offset)) {
+                message.param = std::to_string(discipline) + std::string(".") + std::to_string(section[9]) +
+                                std::string(".") + std::to_string(section[10]);
+                message.step = (long) readBE(section + 18,4);
+                message.level_type = section[22];
+                long scaled_value = (long) readBE(section + 24,4);
+                int scale_factor = (signed char) section[23];
+                for (; scale_factor > 0; scale_factor--) scaled_value /= 10;
+                for (; scale_factor < 0; scale_factor++) scaled_value *= 10;
+                message.level = scaled_value;
+                break;
+             }
+             section_offset += section_length;
+          }
+       }
+       else {
+          break;
+       }
+
+       // A complete message ends with '7777'
+       unsigned char end[4];
+       if (message.length < 16 || offset + message.length > file_size ||
+           readAt(fd,end,4,offset + message.length - 4) || memcmp(end,"7777",4) != 0) break;
+       messages.push_back(message);
+       offset += message.length;
+    }
+    close(fd);
+    return (offset == file_size) ? 0 : 1;
+}
+
+// Reduce a GRIB file to the kept messages and write its index, a line of offset, length, edition, parameter,
+// level type, level and step for each message in the reduced file
+int filterGribFile(const std::string &grib_path, const std::vector<GRIB_SELECT> &keep, const std::string &index_path) {
+    std::vector<GRIB_MESSAGE> messages, kept;
+    uint64_t kept_size = 0, total_size = 0;
+
+    if (scanGribFile(grib_path,messages)) return 1;
+    for (auto &message : messages) {
+       total_size += message.length;
+       if (!keepGribMessage(message,keep)) continue;
+       kept.push_back(message);
+       kept.back().offset = kept_size;
+       kept_size += message.length;
+    }
+
+    // Rewrite the file with only the kept messages
+    if (kept.size() < messages.size()) {
+       std::string filtered_path = grib_path + std::string(".tmp");
+       int in_fd = open(grib_path.c_str(),O_RDONLY);
+       int out_fd = open(filtered_path.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+       int retval = (in_fd < 0 || out_fd < 0);
+       std::vector<unsigned char> buffer(4 * 1024 * 1024);
+       for (size_t ii = 0; !retval && ii < messages.size(); ii++) {
+          if (!keepGribMessage(messages[ii],keep)) continue;
+          for (uint64_t done = 0; !retval && done < messages[ii].length; ) {
+             size_t length = (size_t) std::min((uint64_t) buffer.size(),messages[ii].length - done);
+             retval = readAt(in_fd,buffer.data(),length,messages[ii].offset + done);
+             if (!retval && write(out_fd,buffer.data(),length) != (ssize_t) length) retval = 1;
+             done += length;
+          }
+       }
+       if (in_fd >= 0) close(in_fd);
+       if (out_fd >= 0 && close(out_fd) != 0) retval = 1;
+       if (retval || rename(filtered_path.c_str(),grib_path.c_str()) != 0) {
+          std::error_code ec;
+          fs::remove(filtered_path,ec);
+          return 1;
+       }
+       fprintf(stderr,"Kept %lu of %lu GRIB messages in %s, %.1f MB of %.1f MB\n",(unsigned long) kept.size(),
+               (unsigned long) messages.size(),stripPath(grib_path.c_str()),kept_size / 1.0e6,total_size / 1.0e6);
+    }
+
+    std::ofstream index_file(index_path);
+    if (!index_file.is_open()) return 1;
+    index_file << "# offset length edition param level_type level step\n";
+    for (auto &message : kept) {
+       index_file << message.offset << " " << message.length << " " << message.edition << " " << message.param << " "
+                  << message.level_type << " " << message.level << " " << message.step << "\n";
+    }
+    index_file.close();
+    return index_file.fail() ? 1 : 0;
+}
+
+// Parse a keep list of comma separated 'param[/level_type[/level]]' entries
+int parseKeepList(const std::string &keep_list, std::vector<GRIB_SELECT> &keep) {
+    std::stringstream list_stream(keep_list);
+    std::string entry;
+
+    keep.clear();
+    while (std::getline(list_stream,entry,',')) {
+       std::vector<std::string> fields;
+       std::stringstream entry_stream(entry);
+       std::string field;
+       while (std::getline(entry_stream,field,'/')) fields.push_back(field);
+       if (fields.empty() || fields.size() > 3 || fields[0].empty() ||
+           fields[0].find_first_not_of("0123456789.") != std::string::npos) return 1;
+
+       GRIB_SELECT select;
+       select.param = fields[0];
+       select.level_type = (fields.size() > 1) ? atoi(fields[1].c_str()) : -1;
+       select.level = (fields.size() > 2) ? atol(fields[2].c_str()) : -1;
+       keep.push_back(select);
+    }
+    return keep.empty() ? 1 : 0;
+}
+
+// Whether a GRIB message is in the keep list, an empty keep list keeps every message
+bool keepGribMessage(const GRIB_MESSAGE &message, const std::vector<GRIB_SELECT> &keep) {
+    if (keep.empty()) return true;
+    for (auto &select : keep) {
+       if (select.param != message.param) continue;
+       if (select.level_type >= 0 && select.level_type != message.level_type) continue;
+       if (select.level >= 0 && select.level != message.level) continue;
+       return true;
+    }
+    return false;
+}
+
+
+// Find the packed values of a GRIB1 message with simple grid point packing, returns false for other packings
+bool simplePacking(const std::vector<unsigned char> &message, GRIB_PACKING &packing) {
+    if (message.size() < 40 || memcmp(message.data(),"GRIB",4) != 0 || message[7] != 1) return false;
+
+    // ECMWF large messages code their lengths differently
+    if (message[4] & 0x80) return false;
+
+    size_t offset = 8;
+    size_t pds_length = readBE(message.data() + offset,3);
+    int section_flags = message[offset + 7];
+    offset += pds_length;
+    if ((section_flags & 0x80) && offset + 3 <= message.size()) offset += readBE(message.data() + offset,3);
+    if ((section_flags & 0x40) && offset + 3 <= message.size()) offset += readBE(message.data() + offset,3);
+    if (offset + 11 > message.size()) return false;
+
+    // Section 4, the binary data section, without spherical harmonics, complex packing or additional flags
+    size_t bds_length = readBE(message.data() + offset,3);
+    int bds_flags = message[offset + 3];
+    if (bds_flags & 0xD0) return false;
+    packing.nbits = message[offset + 10];
+    if (packing.nbits == 0 || packing.nbits > 32 || bds_length < 11 || offset + bds_length > message.size()) return false;
+
+    uint64_t nbits_total = (uint64_t) (bds_length - 11) * 8 - (bds_flags & 0x0F);
+    packing.nvalues = (uint32_t) (nbits_total / packing.nbits);
+    packing.data_offset = offset + 11;
+    packing.data_length = ((uint64_t) packing.nvalues * packing.nbits + 7) / 8;
+    return packing.nvalues > 0 && packing.data_offset + packing.data_length <= offset + bds_length;
+}
+
+// Unpack big endian values of a number of bits, the byte aligned widths use loops that the compiler vectorizes
+void unpackValues(const unsigned char *packed, uint32_t nvalues, int nbits, uint32_t *values) {
+    if (nbits == 8) {
+       for (uint32_t ii = 0; ii < nvalues; ii++) values[ii] = packed[ii];
+    }
+    else if (nbits == 16) {
+       for (uint32_t ii = 0; ii < nvalues; ii++) values[ii] = ((uint32_t) packed[2*ii] << 8) | packed[2*ii+1];
+    }
+    else if (nbits == 24) {
+       for (uint32_t ii = 0; ii < nvalues; ii++)
+          values[ii] = ((uint32_t) packed[3*ii] << 16) | ((uint32_t) packed[3*ii+1] << 8) | packed[3*ii+2];
+    }
+    else {
+       uint64_t bit = 0;
+       for (uint32_t ii = 0; ii < nvalues; ii++, bit += nbits) {
+          uint64_t word = 0;
+          size_t byte = bit / 8;
+          int nbytes = (int) ((bit % 8 + nbits + 7) / 8);
+          for (int jj = 0; jj < nbytes; jj++) word = (word << 8) | packed[byte + jj];
+          word >>= nbytes * 8 - (int) (bit % 8) - nbits;
+          values[ii] = (uint32_t) (word & ((1ULL << nbits) - 1));
+       }
+    }
+}
+
+// Pack values into big endian values of a number of bits, the inverse of unpackValues
+void packValues(const uint32_t *values, uint32_t nvalues, int nbits, unsigned char *packed) {
+    if (nbits == 8) {
+       for (uint32_t ii = 0; ii < nvalues; ii++) packed[ii] = (unsigned char) values[ii];
+    }
+    else if (nbits == 16) {
+       for (uint32_t ii = 0; ii < nvalues; ii++) {
+          packed[2*ii] = (unsigned char) (values[ii] >> 8);
+          packed[2*ii+1] = (unsigned char) values[ii];
+       }
+    }
+    else if (nbits == 24) {
+       for (uint32_t ii = 0; ii < nvalues; ii++) {
+          packed[3*ii] = (unsigned char) (values[ii] >> 16);
+          packed[3*ii+1] = (unsigned char) (values[ii] >> 8);
+          packed[3*ii+2] = (unsigned char) values[ii];
+       }
+    }
+    else {
+       memset(packed,0,((uint64_t) nvalues * nbits + 7) / 8);
+       uint64_t bit = 0;
+       for (uint32_t ii = 0; ii < nvalues; ii++, bit += nbits) {
+          for (int jj = nbits - 1; jj >= 0; jj--) {
+             uint64_t at = bit + (nbits - 1 - jj);
+             if ((values[ii] >> jj) & 1) packed[at / 8] |= (unsigned char) (0x80 >> (at % 8));
+          }
+       }
+    }
+}
+
+// Repack a GRIB file as deltas of the packed values against the same fields in a reference file, the file of the
+// previous output step. The container, decoded by openifs_delta_decode.py, is little endian:
+//   'ODLT', uint32 version (1), uint32 number of messages, uint16 length and the name of the reference file
+//   then for each message a uint8 kind:
+//     0: the message copied whole, uint64 length and the message
+//     1: uint32 index of the reference message, uint32 length and the message up to the packed values,
+//        uint32 number of values, uint8 bits per value, uint8 number of byte planes, the byte planes of the
+//        zigzag coded differences of the packed values from the reference (least significant plane first),
+//        uint32 length and the rest of the message after the packed values
+// Each delta message is packed back and compared with the original before it is written, a message that does not
+// reproduce exactly is copied whole, so the original file is always reconstructed bit for bit.
+int deltaEncodeGribFile(const std::string &ref_path, const std::string &grib_path, const std::string &delta_path) {
+    std::vector<GRIB_MESSAGE> ref_messages, messages;
+    std::map<std::string,size_t> ref_fields;
+    std::vector<unsigned char> message, ref_message, record, packed;
+    std::vector<uint32_t> values, ref_values, deltas;
+    uint64_t total_size = 0;
+    size_t ndelta = 0;
+    int retval = 0;
+
+    if (scanGribFile(ref_path,ref_messages) || scanGribFile(grib_path,messages)) return 1;
+    for (size_t ii = 0; ii < ref_messages.size(); ii++) {
+       const GRIB_MESSAGE &ref = ref_messages[ii];
+       ref_fields[ref.param + "/" + std::to_string(ref.level_type) + "/" + std::to_string(ref.level)] = ii;
+    }
+
+    int ref_fd = open(ref_path.c_str(),O_RDONLY);
+    int grib_fd = open(grib_path.c_str(),O_RDONLY);
+    std::ofstream delta_file(delta_path,std::ios::binary);
+    if (ref_fd < 0 || grib_fd < 0 || !delta_file.is_open()) retval = 1;
+
+    std::string ref_name = stripPath(ref_path.c_str());
+    record.assign({'O','D','L','T'});
+    appendLE(record,1,4);
+    appendLE(record,messages.size(),4);
+    appendLE(record,ref_name.length(),2);
+    record.insert(record.end(),ref_name.begin(),ref_name.end());
+    delta_file.write((const char*) record.data(),record.size());
+
+    for (size_t ii = 0; !retval && ii < messages.size(); ii++) {
+       const GRIB_MESSAGE &current = messages[ii];
+       message.resize(current.length);
+       if (readAt(grib_fd,message.data(),message.size(),current.offset)) {
+          retval = 1;
+          break;
+       }
+       total_size += message.size();
+
+       // Difference the packed values from the same field of the reference file
+       GRIB_PACKING packing, ref_packing;
+       bool delta = false;
+       auto ref_field = ref_fields.find(current.param + "/" + std::to_string(current.level_type) + "/" + std::to_string(current.level));
+       if (ref_field != ref_fields.end() && simplePacking(message,packing)) {
+          const GRIB_MESSAGE &ref = ref_messages[ref_field->second];
+          ref_message.resize(ref.length);
+          if (!readAt(ref_fd,ref_message.data(),ref_message.size(),ref.offset) && simplePacking(ref_message,ref_packing) &&
+              ref_packing.nvalues == packing.nvalues) {
+             uint32_t nvalues = packing.nvalues;
+             values.resize(nvalues);
+             ref_values.resize(nvalues);
+             deltas.resize(nvalues);
+             unpackValues(message.data() + packing.data_offset,nvalues,packing.nbits,values.data());
+             unpackValues(ref_message.data() + ref_packing.data_offset,nvalues,ref_packing.nbits,ref_values.data());
+             for (uint32_t jj = 0; jj < nvalues; jj++) {
+                uint32_t difference = values[jj] - ref_values[jj];
+                deltas[jj] = (difference << 1) ^ (uint32_t) ((int32_t) difference >> 31);
+             }
+
+             // Reconstruct the packed values from the deltas and check they match the message exactly
+             for (uint32_t jj = 0; jj < nvalues; jj++)
+                values[jj] = ref_values[jj] + ((deltas[jj] >> 1) ^ (0U - (deltas[jj] & 1)));
+             packed.resize(packing.data_length);
+             packValues(values.data(),nvalues,packing.nbits,packed.data());
+             delta = (memcmp(packed.data(),message.data() + packing.data_offset,packing.data_length) == 0);
+          }
+       }
+
+       record.clear();
+       if (delta) {
+          uint32_t nvalues = packing.nvalues;
+          int nplanes = std::min(4,(packing.nbits + 1 + 7) / 8);
+          size_t rest_offset = packing.data_offset + packing.data_length;
+          appendLE(record,1,1);
+          appendLE(record,ref_field->second,4);
+          appendLE(record,packing.data_offset,4);
+          record.insert(record.end(),message.begin(),message.begin() + packing.data_offset);
+          appendLE(record,nvalues,4);
+          appendLE(record,packing.nbits,1);
+          appendLE(record,nplanes,1);
+          size_t planes_offset = record.size();
+          record.resize(planes_offset + (size_t) nplanes * nvalues);
+          for (int plane = 0; plane < nplanes; plane++) {
+             unsigned char *plane_data = record.data() + planes_offset + (size_t) plane * nvalues;
+             for (uint32_t jj = 0; jj < nvalues; jj++) plane_data[jj] = (unsigned char) (deltas[jj] >> (8 * plane));
+          }
+          appendLE(record,message.size() - rest_offset,4);
+          record.insert(record.end(),message.begin() + rest_offset,message.end());
+          ndelta++;
+       }
+       else {
+          appendLE(record,0,1);
+          appendLE(record,message.size(),8);
+          record.insert(record.end(),message.begin(),message.end());
+       }
+       delta_file.write((const char*) record.data(),record.size());
+    }
+
+    if (ref_fd >= 0) close(ref_fd);
+    if (grib_fd >= 0) close(grib_fd);
+    delta_file.close();
+    if (retval || delta_file.fail()) return 1;
+
+    std::error_code ec;
+    fprintf(stderr,"Repacked %lu of %lu GRIB messages in %s as deltas against %s, %.1f MB to %.1f MB before compression\n",
+            (unsigned long) ndelta,(unsigned long) messages.size(),stripPath(grib_path.c_str()),ref_name.c_str(),
+            total_size / 1.0e6,fs::file_size(delta_path,ec) / 1.0e6);
+    return 0;
+}
+
+
+// The number of Gaussian latitudes of the grid given by the horizontal resolution (the spectral truncation) and the
+// grid type of openifs_wu_submit.py: quadratic '_2' (N = (3T+3)/4), cubic '_3' and octahedral cubic '_4' (N = T+1),
+// otherwise linear 'l_2' and '_full' (N = (T+1)/2)
+int gaussianLatitudes(const std::string &grid_type, int horiz_resolution) {
+    if (horiz_resolution <= 0) return 0;
+    if (grid_type == "_2") return 2 * ((3 * horiz_resolution + 3) / 4);
+    if (grid_type == "_3" || grid_type == "_4") return 2 * (horiz_resolution + 1);
+    return 2 * ((horiz_resolution + 1) / 2);
+}
+
+// The Gaussian latitudes (in degrees, north to south) and weights (summing to 2) of a number of latitudes, from the
+// roots of the Legendre polynomial found by Newton iteration
+void gaussianWeights(int nlat, std::vector<double> &latitudes, std::vector<double> &weights) {
+    latitudes.assign(nlat,0);
+    weights.assign(nlat,0);
+    for (int ii = 0; ii < (nlat + 1) / 2; ii++) {
+       double x = cos(M_PI * (ii + 0.75) / (nlat + 0.5)), derivative = 1;
+       for (int iteration = 0; iteration < 100; iteration++) {
+          double p0 = 1, p1 = x;
+          for (int n = 2; n <= nlat; n++) {
+             double p2 = ((2 * n - 1) * x * p1 - (n - 1) * p0) / n;
+             p0 = p1;
+             p1 = p2;
+          }
+          derivative = nlat * (x * p1 - p0) / (x * x - 1);
+          double step = p1 / derivative;
+          x -= step;
+          if (fabs(step) < 1.0e-15) break;
+       }
+       latitudes[ii] = asin(x) * 180 / M_PI;
+       latitudes[nlat - 1 - ii] = -latitudes[ii];
+       weights[ii] = weights[nlat - 1 - ii] = 2 / ((1 - x * x) * derivative * derivative);
+    }
+}
+
+// Convert a GRIB1 IBM single precision float
+double ibmFloat(const unsigned char *bytes) {
+    int sign = (bytes[0] & 0x80) ? -1 : 1;
+    int exponent = (bytes[0] & 0x7F) - 64;
+    double mantissa = (double) readBE(bytes + 1,3) / 16777216.0;
+    return sign * mantissa * pow(16.0,exponent);
+}
+
+// Summarise the selected fields of a GRIB1 file on a reduced or regular Gaussian grid: the area weighted global mean
+// and the means of three latitude bands, the minimum, the maximum and a histogram of 16 bins between the minimum and
+// the maximum. A line is written to the record for each field.
+int diagnoseGribFile(const std::string &grib_path, const std::vector<GRIB_SELECT> &params, int nlat, std::string &record) {
+    std::vector<GRIB_MESSAGE> messages;
+    std::vector<unsigned char> message;
+    std::vector<uint32_t> packed_values;
+    std::vector<double> latitudes, weights, values;
+    std::vector<int> row_points;
+    std::string file_name = stripPath(grib_path.c_str());
+    char line[1024];
+
+    record.clear();
+    if (scanGribFile(grib_path,messages)) return 1;
+    int fd = open(grib_path.c_str(),O_RDONLY);
+    if (fd < 0) return 1;
+
+    for (auto &grib_message : messages) {
+       if (grib_message.edition != 1 || !keepGribMessage(grib_message,params)) continue;
+       message.resize(grib_message.length);
+       GRIB_PACKING packing;
+       if (readAt(fd,message.data(),message.size(),grib_message.offset) || !simplePacking(message,packing)) continue;
+
+       // The rows of the Gaussian grid from the grid description section, the points of each row of a reduced grid
+       // are listed after the vertical coordinates
+       const unsigned char *pds = message.data() + 8;
+       if (!(pds[7] & 0x80) || (pds[7] & 0x40)) continue;
+       const unsigned char *gds = pds + readBE(pds,3);
+       size_t gds_length = readBE(gds,3);
+       if (gds[5] != 4) continue;
+       int grid_nlat = (int) readBE(gds + 8,2), grid_nlon = (int) readBE(gds + 6,2);
+       row_points.assign(grid_nlat,grid_nlon);
+       if (grid_nlon == 0xFFFF) {
+          size_t pl_offset = (gds[4] - 1) + 4 * (size_t) gds[3];
+          if (gds[4] == 255 || pl_offset + 2 * (size_t) grid_nlat > gds_length) continue;
+          for (int jj = 0; jj < grid_nlat; jj++) row_points[jj] = (int) readBE(gds + pl_offset + 2 * jj,2);
+       }
+       size_t npoints = 0;
+       for (int points : row_points) npoints += points;
+       if (npoints != packing.nvalues) continue;
+       if (nlat != grid_nlat) {
+          if (nlat > 0) fprintf(stderr,"..The grid of %s has %i latitudes, not the %i of the resolution and grid type\n",
+                                file_name.c_str(),grid_nlat,nlat);
+          nlat = grid_nlat;
+       }
+       if ((int) latitudes.size() != nlat) gaussianWeights(nlat,latitudes,weights);
+
+       // Decode the values, value = (R + X * 2^E) / 10^D
+       const unsigned char *bds = message.data() + packing.data_offset - 11;
+       int binary_scale = (int) readBE(bds + 4,2), decimal_scale = (int) readBE(pds + 26,2);
+       if (binary_scale & 0x8000) binary_scale = -(binary_scale & 0x7FFF);
+       if (decimal_scale & 0x8000) decimal_scale = -(decimal_scale & 0x7FFF);
+       double decimal = pow(10.0,-decimal_scale);
+       double reference = ibmFloat(bds + 6) * decimal, scale = ldexp(1.0,binary_scale) * decimal;
+       packed_values.resize(packing.nvalues);
+       values.resize(packing.nvalues);
+       unpackValues(message.data() + packing.data_offset,packing.nvalues,packing.nbits,packed_values.data());
+       for (uint32_t ii = 0; ii < packing.nvalues; ii++) values[ii] = reference + packed_values[ii] * scale;
+
+       // Reduce each row and weight the rows by their Gaussian weights
+       double minimum = values[0], maximum = values[0], total = 0, total_weight = 0;
+       double band_total[3] = {0,0,0}, band_weight[3] = {0,0,0};
+       size_t start = 0;
+       for (int jj = 0; jj < nlat; jj++) {
+          double row_sum = 0, row_min = values[start], row_max = values[start];
+          for (size_t ii = start; ii < start + row_points[jj]; ii++) {
+             row_sum += values[ii];
+             row_min = std::min(row_min,values[ii]);
+             row_max = std::max(row_max,values[ii]);
+          }
+          start += row_points[jj];
+          minimum = std::min(minimum,row_min);
+          maximum = std::max(maximum,row_max);
+          double row_mean = row_points[jj] ? row_sum / row_points[jj] : 0;
+          int band = (latitudes[jj] < -30) ? 0 : ((latitudes[jj] <= 30) ? 1 : 2);
+          total += weights[jj] * row_mean;
+          total_weight += weights[jj];
+          band_total[band] += weights[jj] * row_mean;
+          band_weight[band] += weights[jj];
+       }
+
+       int histogram[16] = {0};
+       double bin_width = (maximum - minimum) / 16;
+       for (double value : values) {
+          int bin = (bin_width > 0) ? (int) ((value - minimum) / bin_width) : 0;
+          histogram[std::min(bin,15)]++;
+       }
+
+       snprintf(line,sizeof(line),"%s %s %i %li %.7g %.7g %.7g %.7g %.7g %.7g ",file_name.c_str(),grib_message.param.c_str(),
+                grib_message.level_type,grib_message.level,total / total_weight,minimum,maximum,
+                band_weight[0] > 0 ? band_total[0] / band_weight[0] : 0.0,
+                band_weight[1] > 0 ? band_total[1] / band_weight[1] : 0.0,
+                band_weight[2] > 0 ? band_total[2] / band_weight[2] : 0.0);
+       record += line;
+       for (int bin = 0; bin < 16; bin++) record += std::to_string(histogram[bin]) + (bin < 15 ? "," : "\n");
+    }
+    close(fd);
+    return 0;
+}
+
+// Start the diagnostics thread
+void startDiagnostics(DIAG_WORKER &diagnostics) {
+    diagnostics.worker = std::thread(runDiagnostics,&diagnostics);
+}
+
+// The diagnostics thread, summarises the queued ICMGG files in order at the lowest CPU priority until it is stopped
+void runDiagnostics(DIAG_WORKER *diagnostics) {
+    #ifndef __APPLE__ // Linux
+       // The priority of a single thread is set through its thread id
+       if (setpriority(PRIO_PROCESS,(id_t) syscall(SYS_gettid),19) != 0)
+          fprintf(stderr,"..Setting the priority of the diagnostics thread failed\n");
+    #endif
+    if (setIdleIOPriority()) fprintf(stderr,"..Setting the diagnostics thread to idle I/O priority failed\n");
+
+    std::unique_lock<std::mutex> guard(diagnostics->lock);
+    while (true) {
+       diagnostics->changed.wait(guard,[diagnostics]() { return diagnostics->stopping || !diagnostics->pending.empty(); });
+       if (diagnostics->stopping) break;
+
+       std::string grib_file = diagnostics->pending.front();
+       diagnostics->pending.pop_front();
+       guard.unlock();
+
+       std::string record;
+       double cpu_start = threadCpuSeconds();
+       if (diagnoseGribFile(grib_file,diagnostics->params,diagnostics->nlat,record))
+          fprintf(stderr,"..Making the diagnostics of %s failed\n",grib_file.c_str());
+       double cpu_seconds = threadCpuSeconds() - cpu_start;
+
+       guard.lock();
+       diagnostics->cpu_seconds += cpu_seconds;
+       diagnostics->records[grib_file] = record;
+       diagnostics->queued.erase(grib_file);
+       fprintf(stderr,"Diagnostics of %s took %.3f CPU seconds, %.3f CPU seconds in total\n",
+               stripPath(grib_file.c_str()),cpu_seconds,diagnostics->cpu_seconds);
+       diagnostics->changed.notify_all();
+    }
+}
+
+// Queue an ICMGG file to be summarised
+void queueDiagnostics(DIAG_WORKER &diagnostics, const std::string &grib_file) {
+    std::lock_guard<std::mutex> guard(diagnostics.lock);
+    if (diagnostics.queued.count(grib_file) || diagnostics.records.count(grib_file)) return;
+    diagnostics.pending.push_back(grib_file);
+    diagnostics.queued.insert(grib_file);
+    diagnostics.changed.notify_all();
+}
+
+// Take the summary record of an ICMGG file, waiting for it if it is queued and summarising it on the calling thread
+// if it was never queued
+std::string takeDiagnostics(DIAG_WORKER &diagnostics, const std::string &grib_file) {
+    std::string record;
+    {
+       std::unique_lock<std::mutex> guard(diagnostics.lock);
+       diagnostics.changed.wait(guard,[&]() {
+          return diagnostics.stopping || diagnostics.records.count(grib_file) || !diagnostics.queued.count(grib_file);
+       });
+       auto found = diagnostics.records.find(grib_file);
+       if (found != diagnostics.records.end()) {
+          record = found->second;
+          diagnostics.records.erase(found);
+          return record;
+       }
+    }
+
+    double cpu_start = threadCpuSeconds();
+    if (diagnoseGribFile(grib_file,diagnostics.params,diagnostics.nlat,record))
+       fprintf(stderr,"..Making the diagnostics of %s failed\n",grib_file.c_str());
+    double cpu_seconds = threadCpuSeconds() - cpu_start;
+
+    std::lock_guard<std::mutex> guard(diagnostics.lock);
+    diagnostics.cpu_seconds += cpu_seconds;
+    fprintf(stderr,"Diagnostics of %s took %.3f CPU seconds, %.3f CPU seconds in total\n",
+            stripPath(grib_file.c_str()),cpu_seconds,diagnostics.cpu_seconds);
+    return record;
+}
+
+// The CPU time of the calling thread in seconds
+double threadCpuSeconds() {
+    struct timespec cpu_time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&cpu_time);
+    return cpu_time.tv_sec + cpu_time.tv_nsec / 1.0e9;
+}
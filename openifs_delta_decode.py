@@ -0,0 +1,165 @@
+#! /usr/bin/python2.7
+
+# Script to reconstruct the ICMGG GRIB files repacked as deltas ('.odl' files) by the OpenIFS controller
+
+# Usage: openifs_delta_decode.py <folder of an unzipped upload file>
+
+# Each '<ICMGG file>.odl' file is decoded against the GRIB file of the previous output step named in its header,
+# which is either zipped whole or itself decoded first, and written out as '<ICMGG file>'. The container is described
+# with deltaEncodeGribFile in openifs.cpp.
+
+import os, struct, sys
+
+
+def unpack_values(packed, nvalues, nbits):
+    # Unpack big endian values of a number of bits
+    packed = bytearray(packed) + bytearray(4)
+    mask = (1 << nbits) - 1
+    values = []
+    bit = 0
+    for ii in range(nvalues):
+        byte = bit >> 3
+        word = 0
+        for jj in range(5):
+            word = (word << 8) | packed[byte + jj]
+        values.append((word >> (40 - (bit & 7) - nbits)) & mask)
+        bit += nbits
+    return values
+
+
+def pack_values(values, nbits, length):
+    # Pack values into big endian values of a number of bits, padded with zero bits to the length in bytes
+    packed = bytearray()
+    accumulator = 0
+    naccumulated = 0
+    for value in values:
+        accumulator = (accumulator << nbits) | value
+        naccumulated += nbits
+        while naccumulated >= 8:
+            naccumulated -= 8
+            packed.append((accumulator >> naccumulated) & 0xFF)
+        accumulator &= (1 << naccumulated) - 1
+    if naccumulated:
+        packed.append((accumulator << (8 - naccumulated)) & 0xFF)
+    packed.extend(bytearray(length - len(packed)))
+    return bytes(packed)
+
+
+def scan_grib(data):
+    # Split a GRIB file into its messages, using the message lengths of section 0
+    messages = []
+    offset = 0
+    while offset < len(data):
+        if data[offset:offset+4] != b'GRIB':
+            raise ValueError('no GRIB message at offset %d' % offset)
+        edition = struct.unpack('B', data[offset+7:offset+8])[0]
+        if edition == 1:
+            length = struct.unpack('>I', b'\x00' + data[offset+4:offset+7])[0]
+            if length & 0x800000:
+                # ECMWF large GRIB1 messages code the total length in units of 120 bytes, corrected by the length of
+                # section 4 when that is below 120, as in scanGribFile in openifs.cpp
+                section_offset = offset + 8
+                flags = struct.unpack('B', data[section_offset+7:section_offset+8])[0]
+                section_offset += struct.unpack('>I', b'\x00' + data[section_offset:section_offset+3])[0]
+                if flags & 0x80:
+                    section_offset += struct.unpack('>I', b'\x00' + data[section_offset:section_offset+3])[0]
+                if flags & 0x40:
+                    section_offset += struct.unpack('>I', b'\x00' + data[section_offset:section_offset+3])[0]
+                bds_length = struct.unpack('>I', b'\x00' + data[section_offset:section_offset+3])[0]
+                length = (length & 0x7FFFFF) * 120
+                if bds_length <= 120:
+                    length = length - bds_length + 4
+        else:
+            length = struct.unpack('>Q', data[offset+8:offset+16])[0]
+        messages.append(data[offset:offset+length])
+        offset += length
+    return messages
+
+
+def decode(delta_path, output_path, reference_folder):
+    with open(delta_path, 'rb') as delta_file:
+        data = delta_file.read()
+    if data[0:4] != b'ODLT':
+        raise ValueError(delta_path + ' is not a delta file')
+    version, nmessages, name_length = struct.unpack('<IIH', data[4:14])
+    if version != 1:
+        raise ValueError('unsupported delta file version %d' % version)
+    offset = 14
+    reference_name = data[offset:offset+name_length].decode('ascii')
+    offset += name_length
+
+    with open(os.path.join(reference_folder, reference_name), 'rb') as reference_file:
+        reference_messages = scan_grib(reference_file.read())
+
+    output = []
+    for ii in range(nmessages):
+        kind = struct.unpack('B', data[offset:offset+1])[0]
+        offset += 1
+        if kind == 0:
+            length = struct.unpack('<Q', data[offset:offset+8])[0]
+            offset += 8
+            output.append(data[offset:offset+length])
+            offset += length
+            continue
+
+        reference_index, head_length = struct.unpack('<II', data[offset:offset+8])
+        offset += 8
+        head = data[offset:offset+head_length]
+        offset += head_length
+        nvalues, nbits, nplanes = struct.unpack('<IBB', data[offset:offset+6])
+        offset += 6
+        planes = [bytearray(data[offset+plane*nvalues:offset+(plane+1)*nvalues]) for plane in range(nplanes)]
+        offset += nplanes * nvalues
+        rest_length = struct.unpack('<I', data[offset:offset+4])[0]
+        offset += 4
+        rest = data[offset:offset+rest_length]
+        offset += rest_length
+
+        # The packed values of the reference message follow section 4's 11 byte header
+        reference = reference_messages[reference_index]
+        reference_head = bytearray(reference)
+        section_offset = 8
+        pds_length = struct.unpack('>I', b'\x00' + reference[8:11])[0]
+        flags = reference_head[15]
+        section_offset += pds_length
+        if flags & 0x80:
+            section_offset += struct.unpack('>I', b'\x00' + reference[section_offset:section_offset+3])[0]
+        if flags & 0x40:
+            section_offset += struct.unpack('>I', b'\x00' + reference[section_offset:section_offset+3])[0]
+        reference_nbits = reference_head[section_offset+10]
+        reference_start = section_offset + 11
+        reference_length = (nvalues * reference_nbits + 7) // 8
+        reference_values = unpack_values(reference[reference_start:reference_start+reference_length], nvalues,
+                                         reference_nbits)
+
+        values = []
+        for jj in range(nvalues):
+            zigzag = 0
+            for plane in range(nplanes):
+                zigzag |= planes[plane][jj] << (8 * plane)
+            difference = (zigzag >> 1) ^ (-(zigzag & 1) & 0xFFFFFFFF)
+            values.append((reference_values[jj] + difference) & 0xFFFFFFFF)
+        output.append(head + pack_values(values, nbits, (nvalues * nbits + 7) // 8) + rest)
+
+    with open(output_path, 'wb') as output_file:
+        for message in output:
+            output_file.write(message)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('Usage: openifs_delta_decode.py <folder of an unzipped upload file>')
+        sys.exit(1)
+    folder = sys.argv[1]
+
+    # Decode in step order so that the reference of each file has been reconstructed before it is needed
+    delta_files = sorted(name for name in os.listdir(folder) if name.endswith('.odl'))
+    for delta_name in delta_files:
+        output_name = delta_name[:-len('.odl')]
+        decode(os.path.join(folder, delta_name), os.path.join(folder, output_name), folder)
+        os.remove(os.path.join(folder, delta_name))
+        print('Decoded ' + output_name)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,167 @@
+#! /usr/bin/python2.7
+
+# Script to check that the ICMGG files repacked as deltas by the OpenIFS controller are reconstructed bit for bit
+# by openifs_delta_decode.py
+
+# Usage: openifs_delta_test.py <compiled controller executable>
+
+# A series of ICMGG GRIB1 files of three output steps is written to a temporary folder. The files after the first
+# are delta encoded against the file of the previous step with the controller's 'delta_encode' command, decoded with
+# openifs_delta_decode.py and compared byte for byte with the originals. The fields cover the byte aligned and the
+# other bit widths, a change of width between steps, unused bits at the end of the data, a bitmap, a field missing
+# from the reference, and spherical harmonics and an ECMWF large GRIB1 message, which are copied whole.
+
+import os, random, re, shutil, struct, subprocess, sys, tempfile
+
+DECODER = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'openifs_delta_decode.py')
+NVALUES = 1000
+
+
+def be(value, nbytes):
+    # A big endian unsigned integer of a number of bytes
+    return struct.pack('>Q', value)[8-nbytes:]
+
+
+def pack_values(values, nbits):
+    # Pack values into big endian values of a number of bits, padded with zero bits to a whole byte
+    packed = bytearray()
+    accumulator = 0
+    naccumulated = 0
+    for value in values:
+        accumulator = (accumulator << nbits) | value
+        naccumulated += nbits
+        while naccumulated >= 8:
+            naccumulated -= 8
+            packed.append((accumulator >> naccumulated) & 0xFF)
+        accumulator &= (1 << naccumulated) - 1
+    if naccumulated:
+        packed.append((accumulator << (8 - naccumulated)) & 0xFF)
+    return bytes(packed)
+
+
+def grib1_message(param, level_type, level, step, values, nbits, bitmap=False, spherical=False):
+    # A GRIB1 message with simple packing of the values, which are already scaled integers
+    flags = 0x40 if bitmap else 0x00
+    pds = bytearray(28)
+    pds[0:3] = be(28, 3)
+    pds[3] = 128
+    pds[4] = 98
+    pds[7] = flags
+    pds[8] = param
+    pds[9] = level_type
+    pds[10:12] = be(level, 2)
+    pds[18] = step
+    sections = bytes(pds)
+    if bitmap:
+        bits = pack_values([1] * len(values), 1)
+        sections += be(6 + len(bits), 3) + b'\x00\x00\x00' + bits
+    data = pack_values(values, nbits)
+    # Section 4 has an even length, the unused bits at the end of the data are in the low bits of the flags
+    length = 11 + len(data)
+    padding = length % 2
+    unused = (len(data) + padding) * 8 - len(values) * nbits
+    bds_flags = (0x80 if spherical else 0x00) | unused
+    sections += be(length + padding, 3) + bytes(bytearray([bds_flags])) + be(0, 2) + be(0, 4) + \
+                bytes(bytearray([nbits])) + data + b'\x00' * padding
+    body = sections + b'7777'
+    return b'GRIB' + be(8 + len(body), 3) + b'\x01' + body
+
+
+def grib1_large_message(param, step, length):
+    # A GRIB1 message of a length coded as an ECMWF large message: the total length in units of 120 bytes with the
+    # top bit set, and in place of the length of section 4 the correction to it, at most 120
+    units = (length - 4 + 120) // 120
+    correction = units * 120 - length + 4
+    pds = bytearray(28)
+    pds[0:3] = be(28, 3)
+    pds[3] = 128
+    pds[4] = 98
+    pds[8] = param
+    pds[9] = 1
+    pds[18] = step
+    bds = be(correction, 3) + b'\x00' + be(0, 2) + be(0, 4) + b'\x10'
+    filler = length - 8 - len(pds) - len(bds) - 4
+    body = bytes(pds) + bds + bytes(bytearray(random.randint(0, 255) for ii in range(filler))) + b'7777'
+    return b'GRIB' + be(0x800000 | units, 3) + b'\x01' + body
+
+
+def write_step(folder, step, previous):
+    # Write the ICMGG file of an output step, its fields drift from those of the previous step
+    fields = [(167, 1, 0, 16, {}), (151, 1, 0, 12, {}), (130, 100, 500, 24, {}), (130, 100, 850, 8, {}),
+              (133, 100, 500, 13, {}), (138, 100, 500, 32, {}), (141, 1, 0, 10, {'bitmap': True}),
+              (152, 1, 0, 16, {'spherical': True})]
+    # The width of a field changes between steps, and a field is only written after the first step
+    fields.append((228, 1, 0, 18 if step else 16, {}))
+    if step:
+        fields.append((164, 1, 0, 7, {}))
+
+    messages = []
+    values = {}
+    for param, level_type, level, nbits, options in fields:
+        key = (param, level_type, level)
+        limit = (1 << nbits) - 1
+        if key in previous:
+            field = [min(max(value + random.randint(-300, 300), 0), limit) for value in previous[key]]
+        else:
+            field = [random.randint(0, limit) for ii in range(NVALUES)]
+        values[key] = field
+        messages.append(grib1_message(param, level_type, level, step, field, nbits, **options))
+        # A large message among the others, in the reference as well, checks the split of the files around it
+        if param == 130 and level == 500:
+            messages.append(grib1_large_message(129, step, 2000 + 37 * step))
+    with open(os.path.join(folder, 'ICMGGtest+%06d' % step), 'wb') as grib_file:
+        grib_file.write(b''.join(messages))
+    return values
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('Usage: openifs_delta_test.py <compiled controller executable>')
+        sys.exit(1)
+    controller = os.path.abspath(sys.argv[1])
+    random.seed(1)
+    folder = tempfile.mkdtemp(prefix='openifs_delta_test_')
+    originals = os.path.join(folder, 'originals')
+    upload = os.path.join(folder, 'upload')
+    os.mkdir(originals)
+    os.mkdir(upload)
+
+    failed = False
+    try:
+        values = {}
+        steps = [0, 6, 12]
+        for step in steps:
+            values = write_step(originals, step, values)
+
+        # The first file is zipped whole, each file after it is encoded against the previous step
+        shutil.copy(os.path.join(originals, 'ICMGGtest+%06d' % steps[0]), upload)
+        for previous, step in zip(steps[:-1], steps[1:]):
+            name = 'ICMGGtest+%06d' % step
+            output = subprocess.Popen([controller, 'delta_encode', os.path.join(originals, 'ICMGGtest+%06d' % previous),
+                                       os.path.join(originals, name), os.path.join(upload, name + '.odl')],
+                                      stdout=subprocess.PIPE, stderr=subprocess.STDOUT).communicate()[0].decode()
+            repacked = re.search(r'Repacked (\d+) of (\d+) GRIB messages', output)
+            if not repacked or int(repacked.group(1)) == 0:
+                print('FAIL: encoding ' + name + ' repacked no messages as deltas: ' + output.strip())
+                failed = True
+
+        subprocess.check_call([sys.executable, DECODER, upload])
+        for step in steps:
+            name = 'ICMGGtest+%06d' % step
+            with open(os.path.join(originals, name), 'rb') as original_file:
+                original = original_file.read()
+            decoded_path = os.path.join(upload, name)
+            decoded = open(decoded_path, 'rb').read() if os.path.exists(decoded_path) else None
+            if decoded != original:
+                print('FAIL: ' + name + ' is not reconstructed bit for bit')
+                failed = True
+            else:
+                print('OK: ' + name)
+    finally:
+        shutil.rmtree(folder)
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
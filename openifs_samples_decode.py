@@ -0,0 +1,37 @@
+#! /usr/bin/python2.7
+
+# Script to list the resource samples of the model taken by the OpenIFS controller
+
+# Usage: openifs_samples_decode.py <resources.bin from an unzipped final upload file>
+
+# The samples are printed oldest first as comma separated values. The ring file is described with RESOURCE_SAMPLER
+# in openifs.cpp.
+
+import struct, sys
+
+FIELDS = ['seconds', 'step', 'threads', 'rss', 'peak_rss', 'major_faults', 'read_bytes', 'write_bytes',
+          'voluntary_switches', 'involuntary_switches', 'run_ns', 'delay_ns']
+RECORD = '<III9Q'
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('Usage: openifs_samples_decode.py <resources.bin from an unzipped final upload file>')
+        sys.exit(1)
+    with open(sys.argv[1], 'rb') as ring_file:
+        data = ring_file.read()
+    if data[0:4] != b'ORNG':
+        raise ValueError(sys.argv[1] + ' is not a resource sample file')
+    version, record_size, capacity, interval, nsamples = struct.unpack('<IIIIQ', data[4:28])
+    if version != 1 or record_size != struct.calcsize(RECORD):
+        raise ValueError('unsupported resource sample file version %d' % version)
+
+    # The ring holds the last capacity samples, the oldest of which is at the record after the newest
+    print(','.join(FIELDS))
+    for sample in range(max(0, nsamples - capacity), nsamples):
+        offset = 32 + (sample % capacity) * record_size
+        print(','.join(str(value) for value in struct.unpack(RECORD, data[offset:offset+record_size])))
+
+
+if __name__ == '__main__':
+    main()
@@ -4,6 +4,41 @@
 
 # This script has been written by Andy Bowery (Oxford University, 2019)
 
+
+def model_footprint(horiz_resolution, vert_resolution, grid_type):
+    # The memory and disk in bytes a workunit needs, from the same table as modelFootprint in openifs.cpp: the
+    # linear grid with 91 levels, scaled by the grid points of the grid type and the levels. The memory is for the
+    # most threads the controller runs the model on at the resolution.
+    # The resolution, the memory of the model and of each thread in MB, and the disk in MB
+    table = [(63,700,100,2000), (95,1000,120,2500), (159,1800,200,4000), (255,3800,350,5000), (319,5500,450,7000),
+             (399,8000,600,9000), (511,12500,800,12000), (639,19000,1000,16000), (799,29000,1300,20000),
+             (1279,72000,2500,40000)]
+    horiz_resolution = int(horiz_resolution)
+    vert_resolution = int(vert_resolution)
+    row = table[-1]
+    for entry in table:
+      if entry[0] >= horiz_resolution:
+        row = entry
+        break
+    scale = 1.0
+    if horiz_resolution > table[-1][0]:
+      scale = (float(horiz_resolution) / table[-1][0]) ** 2
+    grid = {'_2': 2.25, '_3': 3.9, '_4': 3.05, '_full': 1.48}.get(grid_type, 1.0)
+    if vert_resolution > 0:
+      scale = scale * vert_resolution / 91.0
+
+    # The most threads the controller runs the model on at the resolution, as in modelThreads in openifs.cpp
+    if horiz_resolution <= 95: max_threads = 2
+    elif horiz_resolution <= 159: max_threads = 4
+    elif horiz_resolution <= 255: max_threads = 8
+    elif horiz_resolution <= 511: max_threads = 16
+    else: max_threads = 32
+
+    memory = (row[1] + row[2] * max_threads) * grid * scale * 1e6
+    disk = row[3] * grid * scale * 1e6
+    return memory, disk
+
+
 if __name__ == "__main__":
 
     #import fileinput
@@ -190,6 +225,34 @@ if __name__ == "__main__":
             upload_frequency = str(model_config.getElementsByTagName('upload_frequency')[0].childNodes[0].nodeValue)
             namelist_template = str(model_config.getElementsByTagName('namelist_template_global')[0].childNodes[0].nodeValue)
             wam_namelist_template = str(model_config.getElementsByTagName('wam_template_global')[0].childNodes[0].nodeValue)
+
+            # Optional settings for the controller, these are written into the workunit namelist as '!KEY=value' tags
+            controller_tags = []
+            diag_params = ''
+            if model_config.getElementsByTagName('upload_codec'):
+              upload_codec = str(model_config.getElementsByTagName('upload_codec')[0].childNodes[0].nodeValue)
+              controller_tags.append('!UPLOAD_CODEC='+upload_codec+'\n')
+            if model_config.getElementsByTagName('upload_keep'):
+              upload_keep = str(model_config.getElementsByTagName('upload_keep')[0].childNodes[0].nodeValue)
+              controller_tags.append('!UPLOAD_KEEP='+upload_keep+'\n')
+            if model_config.getElementsByTagName('upload_delta'):
+              upload_delta = str(model_config.getElementsByTagName('upload_delta')[0].childNodes[0].nodeValue)
+              controller_tags.append('!UPLOAD_DELTA='+upload_delta+'\n')
+            if model_config.getElementsByTagName('diag_params'):
+              diag_params = str(model_config.getElementsByTagName('diag_params')[0].childNodes[0].nodeValue)
+              controller_tags.append('!DIAG_PARAMS='+diag_params+'\n')
+            if model_config.getElementsByTagName('suspend_grace'):
+              suspend_grace = str(model_config.getElementsByTagName('suspend_grace')[0].childNodes[0].nodeValue)
+              controller_tags.append('!SUSPEND_GRACE='+suspend_grace+'\n')
+            if model_config.getElementsByTagName('autotune'):
+              autotune = str(model_config.getElementsByTagName('autotune')[0].childNodes[0].nodeValue)
+              controller_tags.append('!AUTOTUNE='+autotune+'\n')
+            if model_config.getElementsByTagName('launch_profile'):
+              launch_profile = str(model_config.getElementsByTagName('launch_profile')[0].childNodes[0].nodeValue)
+              controller_tags.append('!LAUNCH_PROFILE='+launch_profile+'\n')
+            if model_config.getElementsByTagName('sample_interval'):
+              sample_interval = str(model_config.getElementsByTagName('sample_interval')[0].childNodes[0].nodeValue)
+              controller_tags.append('!SAMPLE_INTERVAL='+sample_interval+'\n')
             
             #print "horiz_resolution: "+horiz_resolution
             #print "vert_resolution: "+vert_resolution
@@ -443,6 +506,9 @@ if __name__ == "__main__":
               upload_handler = str(upload_info.getElementsByTagName('upload_handler')[0].childNodes[0].nodeValue)
               result_template_prefix = str(upload_info.getElementsByTagName('result_template_prefix')[0].childNodes[0].nodeValue)
               result_template = result_template_prefix+'_n'+str(number_of_uploads)+'.xml'
+              # With diagnostics each upload zip is preceded by its summary as a small upload file of its own
+              if diag_params:
+                result_template = result_template_prefix+'_n'+str(number_of_uploads)+'_diag.xml'
               #print "upload_handler: "+upload_handler
               #print "result_template: "+project_dir+result_template
 
@@ -458,6 +524,15 @@ if __name__ == "__main__":
                 "  <max_nbytes>100000000000000</max_nbytes>\n" +\
                 "  <url>"+upload_handler+"</url>\n" +\
                 "</file_info>\n"
+                if diag_params:
+                  output_string=output_string+"<file_info>\n" +\
+                  "  <name><OUTFILE_"+str(upload_iteration)+"/>_diagnostics.txt</name>\n" +\
+                  "  <generated_locally/>\n" +\
+                  "  <optional/>\n" +\
+                  "  <upload_when_present/>\n" +\
+                  "  <max_nbytes>100000000</max_nbytes>\n" +\
+                  "  <url>"+upload_handler+"</url>\n" +\
+                  "</file_info>\n"
 
               output_string = output_string + "<result>\n"
 
@@ -466,6 +541,11 @@ if __name__ == "__main__":
                 "     <file_name><OUTFILE_"+str(upload_iteration)+"/>.zip</file_name>\n" +\
                 "     <open_name>upload_file_"+str(upload_iteration)+".zip</open_name>\n" +\
                 "   </file_ref>\n"
+                if diag_params:
+                  output_string=output_string+"   <file_ref>\n" +\
+                  "     <file_name><OUTFILE_"+str(upload_iteration)+"/>_diagnostics.txt</file_name>\n" +\
+                  "     <open_name>diagnostics_file_"+str(upload_iteration)+".txt</open_name>\n" +\
+                  "   </file_ref>\n"
 
               output_string = output_string + "</result>\n" +\
                 "</output_template>"
@@ -515,6 +595,7 @@ if __name__ == "__main__":
 
             # Write out the workunit file, this is a combination of the fullpos and main namelists
             with open('fort.4', 'w') as workunit_file:
+              workunit_file.writelines(controller_tags)
               workunit_file.writelines(fullpos_file)
               workunit_file.writelines(template_file)
             workunit_file.close()
@@ -561,6 +642,13 @@ if __name__ == "__main__":
             except OSError:
               print "The following file is not present in the download files: "+ifsdata_zip
 
+            # The client ends a task that exceeds its bounds, so until the footprint table has been calibrated from the
+            # peak RSS the controller logs, the bounds are only raised above the flat 12.5 GB and 4 GB by the footprint,
+            # with a margin on the memory
+            memory_footprint, disk_footprint = model_footprint(horiz_resolution, vert_resolution, grid_type)
+            memory_bound = str(int(max(12.5e9, memory_footprint * 1.25)))
+            disk_bound = str(int(max(4e9, disk_footprint)))
+
             # Construct the input template
             input_string="<input_template>\n" +\
               "<file_info>\n" +\
@@ -595,8 +683,8 @@ if __name__ == "__main__":
               "   <command_line> "+str(start_date)+" "+str(exptid)+" "+str(unique_member_id)+" "+batch_prefix+str(batchid)+" "+str(wuid)+" "+str(fclen)+"</command_line>\n" +\
               "   <rsc_fpops_est>"+fpops_est+"</rsc_fpops_est>\n" +\
               "   <rsc_fpops_bound>"+fpops_est+"0</rsc_fpops_bound>\n" +\
-              "   <rsc_memory_bound>12500000000</rsc_memory_bound>\n" +\
-              "   <rsc_disk_bound>4000000000</rsc_disk_bound>\n" +\
+              "   <rsc_memory_bound>"+memory_bound+"</rsc_memory_bound>\n" +\
+              "   <rsc_disk_bound>"+disk_bound+"</rsc_disk_bound>\n" +\
               "   <delay_bound>121.000</delay_bound>\n" +\
               "   <min_quorum>1</min_quorum>\n" +\
               "   <target_nresults>1</target_nresults>\n" +\